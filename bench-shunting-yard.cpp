@@ -0,0 +1,87 @@
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "./shunting-yard.h"
+
+using cparse::calculator;
+using cparse::packToken;
+using cparse::GlobalScope;
+using cparse::TokenMap;
+
+// Rules in the style of the ones evaluated by the applications
+// that embed the parser: comparisons over a few variables,
+// map lookups, string tests and calls to builtin functions.
+const char* rules[] = {
+  "price * qty > 100 && price * qty < 1000",
+  "abs(price - 50) < 10 || qty >= 20",
+  "item.weight * qty + 0.5 < 5",
+  "item.name == 'box' && item.weight > 1",
+  "pow(price, 2) / (qty + 1) > 3",
+  "(price + qty) * (price - qty) != 0",
+};
+
+typedef std::chrono::steady_clock clock_type;
+
+// Evaluate each rule `rounds` times with `eval`, print the elapsed time
+// and return a checksum of the results, so the work is not optimized away:
+template <typename Eval>
+double run(const std::string& name, size_t rounds, TokenMap vars, Eval eval) {
+  double checksum = 0;
+  clock_type::time_point start = clock_type::now();
+
+  for (size_t i = 0; i < rounds; ++i) {
+    vars["price"] = static_cast<double>(i % 97);
+    vars["qty"] = static_cast<int64_t>(i % 31);
+    for (size_t r = 0; r < sizeof(rules) / sizeof(rules[0]); ++r) {
+      checksum += eval(r, vars).asBool();
+    }
+  }
+
+  std::chrono::duration<double, std::milli> elapsed = clock_type::now() - start;
+  std::cout << name << ": " << elapsed.count() << " ms"
+            << " (checksum " << checksum << ")" << std::endl;
+  return checksum;
+}
+
+int main(int argc, char** argv) {
+  size_t rounds = argc > 1 ? std::stoul(argv[1]) : 20000;
+
+  GlobalScope global;
+  TokenMap vars(&global);
+  vars["item"] = TokenMap();
+  vars["item"]["name"] = "box";
+  vars["item"]["weight"] = 0.25;
+
+  std::vector<calculator> interpreted, closures;
+  for (const char* rule : rules) {
+    interpreted.push_back(calculator(rule, global));
+    closures.push_back(calculator(rule, global));
+    closures.back().set_engine(calculator::CLOSURES);
+  }
+
+  std::cout << "Evaluating " << sizeof(rules) / sizeof(rules[0])
+            << " rules " << rounds << " times:" << std::endl;
+
+  double expected = run("calculator::calculate()", rounds, vars,
+      [](size_t r, const TokenMap& vars) { return calculator::calculate(rules[r], vars); });
+  double interpreter = run("calculator::eval() INTERPRETER", rounds, vars,
+      [&](size_t r, const TokenMap& vars) { return interpreted[r].eval(vars); });
+  double tree = run("calculator::eval() CLOSURES", rounds, vars,
+      [&](size_t r, const TokenMap& vars) { return closures[r].eval(vars); });
+
+  cparse::Arena arena;
+  double arena_tree = run("calculator::eval() CLOSURES with an Arena", rounds, vars,
+      [&](size_t r, const TokenMap& vars) {
+        packToken result = closures[r].eval(vars, false, &arena);
+        arena.reset();
+        return result;
+      });
+
+  if (interpreter != expected || tree != expected || arena_tree != expected) {
+    std::cout << "Results differ!" << std::endl;
+    return 1;
+  }
+  return 0;
+}
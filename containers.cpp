@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <string>
 
 #include "./shunting-yard.h"
@@ -9,6 +10,8 @@ using cparse::packToken;
 using cparse::Iterator;
 using cparse::TokenList;
 using cparse::MapData_t;
+using cparse::TokenMap_t;
+using cparse::Symbol;
 
 /* * * * * Initialize TokenMap * * * * */
 
@@ -93,6 +96,221 @@ packToken* TokenList::ListIterator::next() {
 
 void TokenList::ListIterator::reset() { i = 0; }
 
+/* * * * * TokenMap_t class: * * * * */
+
+namespace {
+
+// Find the block and the offset on it of the entry `i`.
+// The block k starts at FIRST * (2^k - 1), so k = log2(i/FIRST + 1):
+inline void locate(size_t i, size_t first, size_t* block, size_t* offset) {
+  size_t n = i / first + 1, k = 0;
+  while (n >>= 1) ++k;
+  *block = k;
+  *offset = i - first * ((size_t(1) << k) - 1);
+}
+
+}  // namespace
+
+TokenMap_t::value_type& TokenMap_t::at(size_t i) {
+  size_t block, offset;
+  locate(i, FIRST_BLOCK, &block, &offset);
+  return this->block(block)[offset];
+}
+
+const TokenMap_t::value_type& TokenMap_t::at(size_t i) const {
+  size_t block, offset;
+  locate(i, FIRST_BLOCK, &block, &offset);
+  return this->block(block)[offset];
+}
+
+TokenMap_t& TokenMap_t::operator=(const TokenMap_t& other) {
+  if (this == &other) return *this;
+
+  clear();
+  for (const value_type& entry : other) {
+    (*this)[entry.first] = entry.second;
+  }
+  return *this;
+}
+
+void TokenMap_t::clear() {
+  for (size_t i = 0; i < FIRST_BLOCK && i < used_; ++i) {
+    first_block[i] = value_type();
+  }
+  blocks.clear();
+  index.clear();
+  count_ = used_ = first_ = 0;
+}
+
+// Returns the position of the first live entry from `i` on, or end():
+size_t TokenMap_t::next(size_t i) const {
+  while (i < used_ && at(i).first.null()) ++i;
+  return i;
+}
+
+// Returns the position of the first key that matches `equal`,
+// or end() if there is none. `hash` is the hash of the key:
+template <typename Equal>
+size_t TokenMap_t::lookup(size_t hash, Equal equal) const {
+  if (index.empty()) {
+    // Small maps are searched linearly, block by block:
+    size_t i = 0;
+    for (size_t b = 0; i < used_; ++b) {
+      const value_type* block = this->block(b);
+      size_t end = std::min(used_ - i, FIRST_BLOCK << b);
+      for (size_t j = 0; j < end; ++j, ++i) {
+        if (!block[j].first.null() && equal(block[j].first)) return i;
+      }
+    }
+    return used_;
+  }
+
+  size_t mask = index.size() - 1;
+  for (size_t s = hash & mask; index[s].entry; s = (s + 1) & mask) {
+    if (index[s].hash == hash && equal(at(index[s].entry - 1).first)) {
+      return index[s].entry - 1;
+    }
+  }
+  return used_;
+}
+
+size_t TokenMap_t::lookup(const Symbol& key) const {
+  if (key.null()) return used_;
+  return lookup(key.hash(), [&key](const Symbol& other) { return other == key; });
+}
+
+size_t TokenMap_t::lookup(const std::string& key) const {
+  size_t hash = Symbol::hash(key.data(), key.size());
+  return lookup(hash, [&key, hash](const Symbol& other) {
+    return other.hash() == hash && other.str() == key;
+  });
+}
+
+void TokenMap_t::index_insert(size_t hash, size_t entry) {
+  size_t mask = index.size() - 1;
+  size_t s = hash & mask;
+  while (index[s].entry) s = (s + 1) & mask;
+  index[s].hash = hash;
+  index[s].entry = entry + 1;
+}
+
+// Rebuild the index keeping its load factor below 1/2:
+void TokenMap_t::reindex() {
+  size_t capacity = 2 * HASH_THRESHOLD;
+  while (capacity < 2 * count_) capacity <<= 1;
+
+  index.assign(capacity, slot_t{0, 0});
+  for (size_t i = next(0); i < used_; i = next(i + 1)) {
+    index_insert(at(i).first.hash(), i);
+  }
+}
+
+// Remove the slot of the entry `entry`:
+void TokenMap_t::index_erase(size_t entry) {
+  size_t mask = index.size() - 1;
+  size_t s = at(entry).first.hash() & mask;
+  while (index[s].entry != entry + 1) s = (s + 1) & mask;
+
+  // Backward shift deletion, so no tombstones are needed:
+  index[s].entry = 0;
+  for (size_t j = (s + 1) & mask; index[j].entry; j = (j + 1) & mask) {
+    size_t home = index[j].hash & mask;
+    bool between = (s <= j) ? (s < home && home <= j) : (s < home || home <= j);
+    if (!between) {
+      index[s] = index[j];
+      index[j].entry = 0;
+      s = j;
+    }
+  }
+}
+
+// Move the live entries to the front, keeping their order,
+// and return the position the live entry at `pos` moves to:
+size_t TokenMap_t::compact(size_t pos) {
+  size_t live = 0, moved = 0;
+  for (size_t i = 0; i < used_; ++i) {
+    if (i == pos) moved = live;
+    if (at(i).first.null()) continue;
+    if (i != live) {
+      at(live) = std::move(at(i));
+      at(i) = value_type();
+    }
+    ++live;
+  }
+  if (pos >= used_) moved = live;
+
+  used_ = count_;
+  first_ = 0;
+  if (!index.empty()) reindex();
+  return moved;
+}
+
+// Erase the entry `i` and return the position
+// the live entry at `pos` has afterwards:
+size_t TokenMap_t::remove(size_t i, size_t pos) {
+  if (!index.empty()) index_erase(i);
+  at(i) = value_type();
+  if (--count_ == 0) {
+    clear();
+    return 0;
+  }
+
+  // Tombstones at the end are simply dropped:
+  while (at(used_ - 1).first.null()) --used_;
+  if (i == first_) first_ = next(i + 1);
+
+  // Compacting costs O(used_) and happens at most once
+  // per count_ erasures, so each erasure is O(1) amortized:
+  if (used_ - count_ > count_) return compact(pos);
+  return std::min(pos, used_);
+}
+
+packToken& TokenMap_t::operator[](const std::string& key) {
+  size_t i = lookup(key);
+  if (i != used_) return at(i).second;
+  return append(Symbol(key));
+}
+
+packToken& TokenMap_t::operator[](const Symbol& key) {
+  size_t i = lookup(key);
+  if (i != used_) return at(i).second;
+  return append(key);
+}
+
+// Add `key`, which must not be on the map yet, after the last entry:
+packToken& TokenMap_t::append(const Symbol& key) {
+  size_t i = used_;
+  size_t block, offset;
+  locate(i, FIRST_BLOCK, &block, &offset);
+  if (block > blocks.size()) {
+    blocks.emplace_back(new value_type[FIRST_BLOCK << block]);
+  }
+  value_type& entry = this->block(block)[offset];
+  entry.first = key;
+  ++count_;
+  ++used_;
+
+  if (!index.empty() && 2 * count_ <= index.size()) {
+    index_insert(key.hash(), i);
+  } else if (count_ > HASH_THRESHOLD) {
+    reindex();
+  }
+  return entry.second;
+}
+
+TokenMap_t::iterator TokenMap_t::erase(iterator it) {
+  size_t i = it.position();
+  if (i >= used_ || at(i).first.null()) return end();
+  return iterator(this, remove(i, next(i + 1)));
+}
+
+size_t TokenMap_t::erase(const std::string& key) {
+  size_t i = lookup(key);
+  if (i == used_) return 0;
+  remove(i, i);
+  return 1;
+}
+
 /* * * * * MapData_t struct: * * * * */
 MapData_t::MapData_t() {}
 MapData_t::MapData_t(TokenMap* p) : parent(p ? new TokenMap(*p) : 0) {}
@@ -117,6 +335,30 @@ MapData_t& MapData_t::operator=(const MapData_t& other) {
 
 /* * * * * TokenMap Class: * * * * */
 
+packToken* TokenMap::find(const Symbol& key) {
+  TokenMap_t::iterator it = map().find(key);
+
+  if (it != map().end()) {
+    return &it->second;
+  } else if (parent()) {
+    return parent()->find(key);
+  } else {
+    return 0;
+  }
+}
+
+const packToken* TokenMap::find(const Symbol& key) const {
+  TokenMap_t::const_iterator it = map().find(key);
+
+  if (it != map().end()) {
+    return &it->second;
+  } else if (parent()) {
+    return parent()->find(key);
+  } else {
+    return 0;
+  }
+}
+
 packToken* TokenMap::find(const std::string& key) {
   TokenMap_t::iterator it = map().find(key);
 
@@ -173,6 +415,10 @@ void TokenMap::insert(std::string key, TokenBase* value) {
   (*this)[key] = packToken(value->clone());
 }
 
+packToken& TokenMap::operator[](const Symbol& key) {
+  return map()[key];
+}
+
 packToken& TokenMap::operator[](const std::string& key) {
   return map()[key];
 }
@@ -27,8 +27,18 @@ packToken::packToken(const TokenMap& map) : base(new TokenMap(map)) {}
 packToken::packToken(const TokenList& list) : base(new TokenList(list)) {}
 
 packToken& packToken::operator=(const packToken& t) {
-  delete base;
-  base = t.base->clone();
+  // Copy it first since `t` might be owned by this token:
+  packToken copy(t);
+  destroy();
+  take(&copy);
+  return *this;
+}
+
+packToken& packToken::operator=(packToken&& t) {
+  // Move it out first since `t` might be owned by this token:
+  packToken moved(std::move(t));
+  destroy();
+  take(&moved);
   return *this;
 }
 
@@ -91,7 +101,7 @@ bool packToken::asBool() const {
     case BOOL_Token:
       return static_cast<Token<uint8_t>*>(base)->val != 0;
     case STR_Token:
-      return static_cast<Token<std::string>*>(base)->val != std::string();
+      return !static_cast<Token<std::string>*>(base)->val.str().empty();
     case MAP_Token:
     case FUNC_Token:
       return true;
@@ -131,12 +141,29 @@ int64_t packToken::asInt() const {
   }
 }
 
-std::string& packToken::asString() const {
-  if (base->type != STR_Token && base->type != VAR_Token && base->type != OP_Token) {
+const std::string& packToken::asString() const {
+  if (base->type == OP_Token) {
+    return static_cast<TokenOp*>(base)->name();
+  }
+  if (base->type != STR_Token && base->type != VAR_Token) {
     static std::string empty;
     return empty;
   }
-  return static_cast<Token<std::string>*>(base)->val;
+  return static_cast<Token<std::string>*>(base)->val.str();
+}
+
+std::string& packToken::asString() {
+  if (base->type == OP_Token) {
+    // Operator names are interned, so they are edited on a copy:
+    thread_local std::string name;
+    name = static_cast<TokenOp*>(base)->name();
+    return name;
+  }
+  if (base->type != STR_Token && base->type != VAR_Token) {
+    static std::string empty;
+    return empty;
+  }
+  return static_cast<Token<std::string>*>(base)->val.mut();
 }
 
 TokenMap& packToken::asMap() const {
@@ -224,9 +251,13 @@ std::string packToken::str(const TokenBase* base, uint32_t nest) {
     case UNARY_Token:
       return "UnaryToken";
     case OP_Token:
-      return static_cast<const Token<std::string>*>(base)->val;
+      return static_cast<const TokenOp*>(base)->name();
+    case SLOT_Token:
+      ss << (static_cast<const TokenSlot*>(base)->save ? "save #" : "load #")
+         << static_cast<const TokenSlot*>(base)->slot;
+      return ss.str();
     case VAR_Token:
-      return static_cast<const Token<std::string>*>(base)->val;
+      return static_cast<const Token<std::string>*>(base)->val.str();
     case REAL_Token:
       ss << static_cast<const Token<double>*>(base)->val;
       return ss.str();
@@ -237,7 +268,7 @@ std::string packToken::str(const TokenBase* base, uint32_t nest) {
       boolval = static_cast<const Token<uint8_t>*>(base)->val;
       return boolval ? "True" : "False";
     case STR_Token:
-      return "\"" + static_cast<const Token<std::string>*>(base)->val + "\"";
+      return "\"" + static_cast<const Token<std::string>*>(base)->val.str() + "\"";
     case FUNC_Token:
       func = static_cast<const Function*>(base);
       if (func->name().size()) return "[Function: " + func->name() + "]";
@@ -7,6 +7,14 @@
 #include <stack>
 #include <utility>  // For std::pair
 #include <cstring>  // For strchr()
+#include <algorithm>  // For std::sort()
+#include <mutex>
+#include <locale>
+#include <cmath>  // For HUGE_VAL
+#include <unordered_map>
+#include <tuple>
+#include <cstddef>  // For std::max_align_t
+#include <stdexcept>  // For std::length_error
 
 using cparse::calculator;
 using cparse::packToken;
@@ -14,13 +22,330 @@ using cparse::TokenBase;
 using cparse::TokenMap;
 using cparse::RefToken;
 using cparse::Operation;
+using cparse::opMap_t;
+using cparse::opDispatch_t;
+using cparse::opSymbol_t;
+using cparse::opSymbols;
+using cparse::OppMap_t;
+using cparse::TokenOp;
+using cparse::Column;
+using cparse::ColumnMap_t;
+using cparse::batchFunc_t;
+using cparse::batchKernel_t;
 using cparse::opID_t;
 using cparse::Config_t;
 using cparse::typeMap_t;
 using cparse::TokenQueue_t;
 using cparse::evaluationData;
 using cparse::rpnBuilder;
+using cparse::Program;
+using cparse::ProgramCache;
+using cparse::Instruction;
+using cparse::Arena;
+using cparse::ClosureProgram;
+using cparse::ClosureNode;
+using cparse::closureContext_t;
 using cparse::REF_Token;
+using cparse::Symbol;
+using cparse::strView_t;
+
+/* * * * * Arena class: * * * * */
+
+namespace {
+
+// The alignment of every allocation made by an Arena:
+const size_t ARENA_ALIGN = alignof(std::max_align_t);
+
+// The header written before each token by TokenBase::allocate(),
+// padded so the token keeps the alignment of its allocation:
+enum tokenSource_t : uint8_t { FROM_HEAP, FROM_ARENA };
+const size_t TOKEN_HEADER = alignof(std::max_align_t);
+
+}  // namespace
+
+Arena::~Arena() {
+  for (block_t& block : blocks) {
+    delete[] block.data;
+  }
+}
+
+void* Arena::allocate(size_t size) {
+  size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+  // Find a block with enough space, allocating a new one if necessary:
+  while (current < blocks.size() && used + size > blocks[current].size) {
+    ++current;
+    used = 0;
+  }
+  if (current == blocks.size()) {
+    size_t block_size = size > BLOCK_SIZE ? size : BLOCK_SIZE;
+    blocks.push_back({new char[block_size], block_size});
+    used = 0;
+  }
+
+  void* ptr = blocks[current].data + used;
+  used += size;
+  return ptr;
+}
+
+bool Arena::owns(const void* ptr) const {
+  const char* p = static_cast<const char*>(ptr);
+  for (const block_t& block : blocks) {
+    if (p >= block.data && p < block.data + block.size) return true;
+  }
+  return false;
+}
+
+void* TokenBase::allocate(size_t size, Arena* arena) {
+  size += TOKEN_HEADER;
+  char* header = static_cast<char*>(arena ? arena->allocate(size) : ::operator new(size));
+  *header = arena ? FROM_ARENA : FROM_HEAP;
+  return header + TOKEN_HEADER;
+}
+
+void TokenBase::release(void* ptr) {
+  // The memory of arenas is only released by Arena::reset():
+  char* header = static_cast<char*>(ptr) - TOKEN_HEADER;
+  if (*header == FROM_HEAP) ::operator delete(header);
+}
+
+TokenBase* cparse::clone(const TokenBase* base, Arena* arena) {
+  if (!arena) return base->clone();
+
+  switch (base->type) {
+  case NONE_Token:
+    return new (arena) TokenNone();
+  case UNARY_Token:
+    return new (arena) TokenUnary();
+  case REAL_Token:
+    return new (arena) Token<double>(*static_cast<const Token<double>*>(base));
+  case INT_Token:
+    return new (arena) Token<int64_t>(*static_cast<const Token<int64_t>*>(base));
+  case BOOL_Token:
+    return new (arena) Token<uint8_t>(*static_cast<const Token<uint8_t>*>(base));
+  case STR_Token: case VAR_Token:
+    return new (arena) Token<std::string>(*static_cast<const Token<std::string>*>(base));
+  case TUPLE_Token:
+    return new (arena) Tuple(*static_cast<const Tuple*>(base));
+  case STUPLE_Token:
+    return new (arena) STuple(*static_cast<const STuple*>(base));
+  case LIST_Token:
+    return new (arena) TokenList(*static_cast<const TokenList*>(base));
+  case MAP_Token:
+    return new (arena) TokenMap(*static_cast<const TokenMap*>(base));
+  default:
+    return base->clone();
+  }
+}
+
+/* * * * * opSymbols class: * * * * */
+
+namespace {
+
+// The interned operators are stored in chunks that are never moved,
+// so their names can be read without locking the table:
+struct opSymbolTable {
+  static const uint32_t CHUNK_SIZE = 256;
+  static const uint32_t MAX_CHUNKS = 256;
+
+  struct entry_t {
+    std::string name;
+    opSymbol_t normalized;
+  };
+
+  std::mutex mutex;
+  std::map<std::string, opSymbol_t> ids;
+  std::unique_ptr<entry_t[]> chunks[MAX_CHUNKS];
+  uint32_t size = 0;
+
+  opSymbolTable() { intern(ANY_OP); }
+
+  entry_t& operator[](opSymbol_t id) {
+    return chunks[id / CHUNK_SIZE][id % CHUNK_SIZE];
+  }
+
+  // Must be called with the mutex locked:
+  opSymbol_t intern(const std::string& op) {
+    auto it = ids.find(op);
+    if (it != ids.end()) return it->second;
+
+    // Id 0 is ANY_OP, so it can't be returned for another operator:
+    if (size == CHUNK_SIZE * MAX_CHUNKS) {
+      throw std::length_error("Too many operators!");
+    }
+
+    opSymbol_t id = size++;
+    if (id % CHUNK_SIZE == 0) {
+      chunks[id / CHUNK_SIZE].reset(new entry_t[CHUNK_SIZE]);
+    }
+    ids[op] = id;
+
+    entry_t& entry = (*this)[id];
+    entry.name = op;
+    entry.normalized = id;
+    if (op[0] == 'L' || op[0] == 'R') {
+      entry.normalized = intern(op.substr(1));
+    }
+    return id;
+  }
+
+  static opSymbolTable& get() {
+    static opSymbolTable table;
+    return table;
+  }
+};
+
+}  // namespace
+
+opSymbol_t opSymbols::intern(const std::string& op) {
+  opSymbolTable& table = opSymbolTable::get();
+  std::lock_guard<std::mutex> lock(table.mutex);
+  return table.intern(op);
+}
+
+const std::string& opSymbols::name(opSymbol_t op) {
+  return opSymbolTable::get()[op].name;
+}
+
+opSymbol_t opSymbols::normalize(opSymbol_t op) {
+  return opSymbolTable::get()[op].normalized;
+}
+
+/* * * * * Symbol class: * * * * */
+
+namespace {
+
+// The entries are indexed by the hashes of their names, so they
+// can be found without copying the name into a std::string.
+// They are never moved while they are referenced, so a Symbol
+// is a plain pointer that can be compared without locking:
+struct symbolTable {
+  std::mutex mutex;
+  std::unordered_multimap<size_t, Symbol::entry_t> entries;
+
+  // Must be called with the mutex locked:
+  const Symbol::entry_t* find(const char* name, size_t size, size_t hash) const {
+    auto range = entries.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it) {
+      const std::string& other = *it->second.name;
+      if (other.size() == size && !memcmp(other.data(), name, size)) return &it->second;
+    }
+    return 0;
+  }
+
+  // It is never destroyed, since Symbols might
+  // still be released by other static objects:
+  static symbolTable& get() {
+    static symbolTable* table = new symbolTable();
+    return *table;
+  }
+};
+
+}  // namespace
+
+// FNV-1a, see http://www.isthe.com/chongo/tech/comp/fnv/
+size_t Symbol::hash(const char* data, size_t size) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ static_cast<uint8_t>(data[i])) * 1099511628211ULL;
+  }
+  return static_cast<size_t>(hash);
+}
+
+Symbol::Symbol(const char* name, size_t size) {
+  size_t hash = Symbol::hash(name, size);
+  symbolTable& table = symbolTable::get();
+  std::lock_guard<std::mutex> lock(table.mutex);
+
+  this->entry = table.find(name, size, hash);
+  if (!this->entry) {
+    auto it = table.entries.emplace(std::piecewise_construct, std::forward_as_tuple(hash),
+                                    std::forward_as_tuple(std::make_shared<std::string>(name, size), hash));
+    this->entry = &it->second;
+  }
+  acquire();
+}
+
+Symbol Symbol::find(const char* name, size_t size) {
+  size_t hash = Symbol::hash(name, size);
+  symbolTable& table = symbolTable::get();
+  std::lock_guard<std::mutex> lock(table.mutex);
+  return Symbol(table.find(name, size, hash));
+}
+
+void Symbol::release(const entry_t* entry) {
+  // Only the last reference is dropped with the table locked,
+  // so an entry is never found while it is being erased:
+  size_t refs = entry->refs.load(std::memory_order_relaxed);
+  while (refs > 1) {
+    if (entry->refs.compare_exchange_weak(refs, refs - 1, std::memory_order_acq_rel)) return;
+  }
+
+  symbolTable& table = symbolTable::get();
+  std::lock_guard<std::mutex> lock(table.mutex);
+  if (entry->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+
+  auto range = table.entries.equal_range(entry->hash);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (&it->second == entry) {
+      table.entries.erase(it);
+      return;
+    }
+  }
+}
+
+size_t Symbol::count() {
+  symbolTable& table = symbolTable::get();
+  std::lock_guard<std::mutex> lock(table.mutex);
+  return table.entries.size();
+}
+
+/* * * * * OppMap_t class: * * * * */
+
+OppMap_t::OppMap_t() {
+  // These operations are hard-coded inside the calculator,
+  // thus their precedence should always be defined:
+  opSymbol_t index = declare("[]"), call = declare("()");
+  info[index].precedence = info[call].precedence = -1;
+  info[index].exists = info[call].exists = true;
+  add("[", 0x7FFFFFFF); add("(", 0x7FFFFFFF); add("{", 0x7FFFFFFF);
+  info[declare("=")].RtoL = true;
+}
+
+// Intern `op` and make sure there is room for its information:
+opSymbol_t OppMap_t::declare(const std::string& op) {
+  opSymbol_t id = opSymbols::intern(op);
+  if (info.size() <= id) info.resize(id + 1);
+  ids[op] = id;
+  return id;
+}
+
+void OppMap_t::add(const std::string& op, int precedence) {
+  opSymbol_t id = declare(op);
+  _generation = nextConfigGeneration();
+
+  if (precedence < 0) {
+    info[id].RtoL = true;
+    precedence = -precedence;
+  }
+
+  info[id].precedence = precedence;
+  info[id].exists = true;
+
+  // Link unary operators, e.g. "L-", to their binary version:
+  opSymbol_t binary = opSymbols::normalize(id);
+  if (binary != id && binary != 0) {
+    declare(opSymbols::name(binary));
+    (op[0] == 'L' ? info[binary].left : info[binary].right) = id;
+  }
+
+  // Rebuild the lexer table with the operators that exist:
+  std::map<std::string, opSymbol_t> operators;
+  for (const auto& pair : ids) {
+    if (info[pair.second].exists) operators.insert(pair);
+  }
+  lexer.build(operators);
+}
 
 /* * * * * Operation class: * * * * */
 
@@ -48,31 +373,120 @@ bool match_op_id(opID_t id, opID_t mask) {
   return false;
 }
 
-TokenBase* exec_operation(const packToken& left, const packToken& right,
-                          evaluationData* data, const std::string& OP_MASK) {
-  auto it = data->opMap.find(OP_MASK);
-  if (it == data->opMap.end())
-    return nullptr;
-  for (const Operation& operation : it->second) {
-    if (match_op_id(data->opID, operation.getMask())) {
-      // try {
-        return operation.exec(left, right, data).release();
-      // } catch (...) { //const Operation::Reject& e  compile warning(may be error)
-      //   continue;
-      // }
+/* * * * * opMap_t class: * * * * */
+
+uint64_t cparse::nextConfigGeneration() {
+  static std::atomic<uint64_t> generation(0);
+  return ++generation;
+}
+
+void opMap_t::freeze() const {
+  std::lock_guard<std::mutex> lock(freezing);
+  if (!dirty.load(std::memory_order_relaxed)) return;
+
+  opDispatch_t table;
+
+  // Collect the masks used on each side of every signature:
+  std::vector<uint32_t> masks;
+  for (const auto& pair : *this) {
+    for (const Operation& operation : pair.second) {
+      masks.push_back(operation.getMask() >> 32);
+      masks.push_back(operation.getMask() & 0xFFFFFFFF);
     }
   }
+  std::sort(masks.begin(), masks.end());
+  masks.erase(std::unique(masks.begin(), masks.end()), masks.end());
+
+  // Group the types that match the same set of masks in the same class:
+  std::map<std::vector<bool>, uint8_t> classes;
+  std::vector<tokType_t> samples;
+  for (uint32_t type = 0; type < 256; ++type) {
+    std::vector<bool> matches;
+    for (uint32_t mask : masks) {
+      matches.push_back(Operation::mask(type) & mask);
+    }
 
-  return nullptr;
-}
+    auto it = classes.find(matches);
+    if (it == classes.end()) {
+      it = classes.insert(std::make_pair(matches, samples.size())).first;
+      samples.push_back(type);
+    }
+    table.typeClass[type] = it->second;
+  }
+  table.classes = samples.size();
 
-inline std::string normalize_op(std::string op) {
-  if (op[0] == 'L' || op[0] == 'R') {
-    op.erase(0, 1);
-    return op;
-  } else {
-    return op;
+  // Give a table to every operator that has operations
+  // or kernels of its own:
+  std::vector<opSymbol_t> ops(1, 0);
+  for (const auto& pair : *this) {
+    ops.push_back(opSymbols::intern(pair.first));
+  }
+  for (const auto& pair : kernels) {
+    ops.push_back(opSymbols::intern(pair.first.second));
+  }
+  std::sort(ops.begin(), ops.end());
+  ops.erase(std::unique(ops.begin(), ops.end()), ops.end());
+
+  // Resolve each pair of classes the same way
+  // the evaluator used to do at each operation:
+  static const opList_t no_operations;
+  auto any_it = this->find(ANY_OP);
+  const opList_t& any_list = any_it == this->end() ? no_operations : any_it->second;
+
+  std::map<std::pair<Operation::opFunc_t, uint8_t>, uint16_t> func_ids;
+  table.entries.clear();
+  table.tables.assign(ops.back() + 1, 0);
+  for (opSymbol_t id : ops) {
+    const std::string& op = opSymbols::name(id);
+    auto op_it = id == 0 ? this->end() : this->find(op);
+    const opList_t& op_list = op_it == this->end() ? no_operations : op_it->second;
+
+    table.tables[id] = table.entries.size();
+    table.entries.resize(table.entries.size() + table.classes * table.classes);
+    uint16_t* entries = &table.entries[table.tables[id]];
+
+    for (uint32_t left = 0; left < table.classes; ++left) {
+      for (uint32_t right = 0; right < table.classes; ++right) {
+        opID_t mask = Operation::build_mask(samples[left], samples[right]);
+        Operation::opFunc_t func = nullptr;
+        uint8_t flags = 0;
+
+        for (const opList_t* list : {&op_list, &any_list}) {
+          for (const Operation& operation : *list) {
+            if (match_op_id(mask, operation.getMask())) {
+              func = operation.getFunc();
+              flags = operation.getFlags();
+              break;
+            }
+          }
+          if (func) break;
+        }
+        if (!func) continue;
+
+        auto kernel = kernels.find(std::make_pair(func, op));
+        if (kernel != kernels.end()) {
+          func = kernel->second;
+        }
+
+        auto f_it = func_ids.find(std::make_pair(func, flags));
+        if (f_it == func_ids.end()) {
+          table.funcs.push_back(func);
+          table.flags.push_back(flags);
+          f_it = func_ids.insert(std::make_pair(std::make_pair(func, flags),
+                                                table.funcs.size())).first;
+        }
+        entries[left * table.classes + right] = f_it->second;
+      }
+    }
   }
+
+  for (Operation::opFunc_t func : table.funcs) {
+    auto it = batchKernels.find(func);
+    table.batchKernels.push_back(it == batchKernels.end() ? batchKernel_t() : it->second);
+  }
+
+  _dispatch = std::move(table);
+  dirty.store(false, std::memory_order_release);
 }
 
 // Use this function to discard a reference to an object
@@ -107,6 +521,19 @@ typeMap_t& calculator::type_attribute_map() {
 
 /* * * * * rpnBuilder Class: * * * * */
 
+// 1 = SPACE_CHAR, 2 = DIGIT_CHAR, 4 = VAR_CHAR and 8 = OP_CHAR:
+const uint8_t rpnBuilder::charClass[256] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 0, 0,  // 0x00
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  // 0x10
+  1, 8, 0, 8, 8, 8, 8, 0, 0, 0, 8, 0, 8, 0, 8, 8,  // 0x20  !"#$%&'()*+,-./
+  2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 8, 8, 8, 8, 8, 8,  // 0x30 0123456789:;<=>?
+  8, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,  // 0x40 @ABCDEFGHIJKLMNO
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 0, 8, 0, 8, 4,  // 0x50 PQRSTUVWXYZ[\]^_
+  8, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,  // 0x60 `abcdefghijklmno
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 0, 8, 0, 8, 0,  // 0x70 pqrstuvwxyz{|}~
+  // The non ASCII characters belong to no class.
+};
+
 void rpnBuilder::cleanRPN(TokenQueue_t* rpn) {
   while (rpn->size()) {
     delete resolve_reference(rpn->front());
@@ -130,28 +557,24 @@ void rpnBuilder::cleanRPN(TokenQueue_t* rpn) {
  *     pop o2 off the stack onto the output queue.
  *   Push o1 on the stack.
  */
-void rpnBuilder::handle_opStack(const std::string& op) {
-  std::string cur_op;
-
+void rpnBuilder::handle_opStack(opSymbol_t op) {
   // If it associates from left to right:
   if (opp.assoc(op) == 0) {
     while (!opStack.empty() &&
         opp.prec(op) >= opp.prec(opStack.top())) {
-      cur_op = normalize_op(opStack.top());
-      rpn.push(new Token<std::string>(cur_op, OP_Token));
+      rpn.push(new TokenOp(opSymbols::normalize(opStack.top())));
       opStack.pop();
     }
   } else {
     while (!opStack.empty() &&
         opp.prec(op) > opp.prec(opStack.top())) {
-      cur_op = normalize_op(opStack.top());
-      rpn.push(new Token<std::string>(cur_op, OP_Token));
+      rpn.push(new TokenOp(opSymbols::normalize(opStack.top())));
       opStack.pop();
     }
   }
 }
 
-void rpnBuilder::handle_binary(const std::string& op) {
+void rpnBuilder::handle_binary(opSymbol_t op) {
   // Handle OP precedence
   handle_opStack(op);
   // Then push the current op into the stack:
@@ -159,40 +582,42 @@ void rpnBuilder::handle_binary(const std::string& op) {
 }
 
 // Convert left unary operators to binary and handle them:
-void rpnBuilder::handle_left_unary(const std::string& unary_op) {
+void rpnBuilder::handle_left_unary(opSymbol_t unary_op) {
   this->rpn.push(new TokenUnary());
   // Only put it on the stack and wait to check op precedence:
   opStack.push(unary_op);
 }
 
 // Convert right unary operators to binary and handle them:
-void rpnBuilder::handle_right_unary(const std::string& unary_op) {
+void rpnBuilder::handle_right_unary(opSymbol_t unary_op) {
   // Handle OP precedence:
   handle_opStack(unary_op);
   // Add the unary token:
   this->rpn.push(new TokenUnary());
   // Then add the current op directly into the rpn:
-  rpn.push(new Token<std::string>(normalize_op(unary_op), OP_Token));
+  rpn.push(new TokenOp(opSymbols::normalize(unary_op)));
 }
 
 // Find out if op is a binary or unary operator and handle it:
-void rpnBuilder::handle_op(const std::string& op) {
+void rpnBuilder::handle_op(opSymbol_t op) {
+  opSymbol_t unary_op;
+
   // If it's a left unary operator:
   if (this->lastTokenWasOp) {
-    if (opp.exists("L"+op)) {
-      handle_left_unary("L"+op);
+    if ((unary_op = opp.leftUnary(op)) != 0) {
+      handle_left_unary(unary_op);
       this->lastTokenWasUnary = true;
-      this->lastTokenWasOp = op[0];
+      this->lastTokenWasOp = opSymbols::name(op)[0];
     } else {
       cleanRPN(&(this->rpn));
       // throw std::domain_error(
-      //     "Unrecognized unary operator: '" + op + "'.");
+      //     "Unrecognized unary operator: '" + opSymbols::name(op) + "'.");
       return;
     }
 
   // If its a right unary operator:
-  } else if (opp.exists("R"+op)) {
-    handle_right_unary("R"+op);
+  } else if ((unary_op = opp.rightUnary(op)) != 0) {
+    handle_right_unary(unary_op);
 
     // Set it to false, since we have already added
     // an unary token and operand to the stack:
@@ -206,12 +631,12 @@ void rpnBuilder::handle_op(const std::string& op) {
     } else {
       cleanRPN(&(rpn));
       // throw std::domain_error(
-      //     "Undefined operator: `" + op + "`!");
+      //     "Undefined operator: `" + opSymbols::name(op) + "`!");
       return;
     }
 
     this->lastTokenWasUnary = false;
-    this->lastTokenWasOp = op[0];
+    this->lastTokenWasOp = opSymbols::name(op)[0];
   }
 }
 
@@ -227,7 +652,7 @@ void rpnBuilder::handle_token(TokenBase* token) {
 }
 
 void rpnBuilder::open_bracket(const std::string& bracket) {
-  opStack.push(bracket);
+  opStack.push(opp.id(bracket));
   lastTokenWasOp = bracket[0];
   lastTokenWasUnary = false;
   ++bracketLevel;
@@ -238,10 +663,9 @@ void rpnBuilder::close_bracket(const std::string& bracket) {
     rpn.push(new Tuple());
   }
 
-  std::string cur_op;
-  while (opStack.size() && opStack.top() != bracket) {
-    cur_op = normalize_op(opStack.top());
-    rpn.push(new Token<std::string>(cur_op, OP_Token));
+  opSymbol_t bracket_op = opp.id(bracket);
+  while (opStack.size() && opStack.top() != bracket_op) {
+    rpn.push(new TokenOp(opSymbols::normalize(opStack.top())));
     opStack.pop();
   }
 
@@ -257,6 +681,104 @@ void rpnBuilder::close_bracket(const std::string& bracket) {
   --bracketLevel;
 }
 
+namespace cparse {
+namespace {
+
+// The powers of 10 that are exactly represented as doubles:
+const double exactPow10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// The value of a digit in base 16 or -1 if it is not one:
+inline int digitValue(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+}  // namespace
+}  // namespace cparse
+
+TokenBase* rpnBuilder::parseNumber(const char* expr, const char** rest) {
+  // Parse the prefix notation for octal and hex numbers,
+  // i.e. 0x1 == 1 in hex notation and 01 == 1 in octal notation:
+  if (expr[0] == '0' && (expr[1] == 'x' || is(expr[1], DIGIT_CHAR))) {
+    int base = (expr[1] == 'x' ? 16 : 8);
+    expr += (base == 16 ? 2 : 1);
+
+    int64_t value = 0;
+    int d;
+    for (; (d = digitValue(*expr)) >= 0 && d < base; ++expr) {
+      value = (value > (INT64_MAX - d) / base) ? INT64_MAX : value * base + d;
+    }
+    if (rest) *rest = expr;
+    return new Token<int64_t>(value, INT_Token);
+  }
+
+  // Decimal numbers are read as mantissa * 10^exponent, keeping
+  // the first 18 significant digits on the mantissa:
+  static const uint64_t MAX_MANTISSA = 100000000000000000ULL;
+  const char* start = expr;
+  int64_t integer = 0;
+  uint64_t mantissa = 0;
+  int64_t exponent = 0;
+
+  for (; is(*expr, DIGIT_CHAR); ++expr) {
+    int d = *expr - '0';
+    integer = (integer > (INT64_MAX - d) / 10) ? INT64_MAX : integer * 10 + d;
+    if (mantissa < MAX_MANTISSA) {
+      mantissa = mantissa * 10 + d;
+    } else {
+      ++exponent;
+    }
+  }
+
+  // If the number is not a real number:
+  if (*expr != '.' && *expr != 'e' && *expr != 'E') {
+    if (rest) *rest = expr;
+    return new Token<int64_t>(integer, INT_Token);
+  }
+
+  if (*expr == '.') {
+    for (++expr; is(*expr, DIGIT_CHAR); ++expr) {
+      if (mantissa < MAX_MANTISSA) {
+        mantissa = mantissa * 10 + (*expr - '0');
+        --exponent;
+      }
+    }
+  }
+
+  // The exponent is only read if it has at least one digit:
+  if (*expr == 'e' || *expr == 'E') {
+    const char* digits = expr + 1 + (expr[1] == '+' || expr[1] == '-');
+    if (is(*digits, DIGIT_CHAR)) {
+      int64_t e = 0;
+      for (expr = digits; is(*expr, DIGIT_CHAR); ++expr) {
+        if (e < 100000) e = e * 10 + (*expr - '0');
+      }
+      exponent += (digits[-1] == '-' ? -e : e);
+    }
+  }
+  if (rest) *rest = expr;
+
+  double value;
+  if (mantissa <= (uint64_t(1) << 53) && exponent >= -22 && exponent <= 22) {
+    // Both the mantissa and the power of 10 are exact, so
+    // a single operation rounds the result correctly:
+    value = static_cast<double>(mantissa);
+    value = exponent < 0 ? value / exactPow10[-exponent] : value * exactPow10[exponent];
+  } else {
+    // Otherwise let the standard library round it, on the classic locale:
+    std::istringstream ss(std::string(start, expr));
+    ss.imbue(std::locale::classic());
+    // It only fails when the number is out of range:
+    if (!(ss >> value)) value = (exponent > 0 ? HUGE_VAL : 0.0);
+  }
+  return new Token<double>(value, REAL_Token);
+}
+
 /* * * * * RAII_TokenQueue_t struct  * * * * */
 
 // Used to make sure an rpn is dealloc'd correctly
@@ -267,6 +789,7 @@ void rpnBuilder::close_bracket(const std::string& bracket) {
 struct calculator::RAII_TokenQueue_t : TokenQueue_t {
   RAII_TokenQueue_t() {}
   RAII_TokenQueue_t(const TokenQueue_t& rpn) : TokenQueue_t(rpn) {}
+  RAII_TokenQueue_t(TokenQueue_t&& rpn) : TokenQueue_t(std::move(rpn)) {}
   ~RAII_TokenQueue_t() { rpnBuilder::cleanRPN(this); }
 
   RAII_TokenQueue_t(const RAII_TokenQueue_t& rpn) {
@@ -274,6 +797,7 @@ struct calculator::RAII_TokenQueue_t : TokenQueue_t {
   }
   RAII_TokenQueue_t& operator=(const RAII_TokenQueue_t& rpn) {
     // throw std::runtime_error("You should not copy this class!");
+    return *this;
   }
 };
 
@@ -283,12 +807,11 @@ TokenQueue_t calculator::toRPN(const char* expr,
                                const TokenMap &vars, const char* delim,
                                const char** rest, const Config_t& config) {
   rpnBuilder data(vars, config.opPrecedence);
-  char* nextChar;
 
   static char c = '\0';
   if (!delim) delim = &c;
 
-  while (*expr && isspace(*expr) && !strchr(delim, *expr)) ++expr;
+  while (rpnBuilder::is(*expr, SPACE_CHAR) && !strchr(delim, *expr)) ++expr;
 
   if (*expr == '\0' || strchr(delim, *expr)) {
     // throw std::invalid_argument("Cannot build a calculator from an empty expression!");
@@ -299,41 +822,18 @@ TokenQueue_t calculator::toRPN(const char* expr,
   // In one pass, ignore whitespace and parse the expression into RPN
   // using Dijkstra's Shunting-yard algorithm.
   while (*expr && (data.bracketLevel || !strchr(delim, *expr))) {
-    if (isdigit(*expr)) {
-      int base = 10;
-      // Parse the prefix notation for octal and hex numbers:
-      if (expr[0] == '0') {
-        if (expr[1] == 'x') {
-          // 0x1 == 1 in hex notation
-          base = 16;
-          expr += 2;
-        } else if (isdigit(expr[1])) {
-          // 01 == 1 in octal notation
-          base = 8;
-          expr++;
-        }
-      }
-
+    if (rpnBuilder::is(*expr, DIGIT_CHAR)) {
       // If the token is a number, add it to the output queue.
-      int64_t _int = strtoll(expr, &nextChar, base);
-
-      // If the number was not a float:
-      if (base != 10 || !strchr(".eE", *nextChar)) {
-        data.handle_token(new Token<int64_t>(_int, INT_Token));
-      } else {
-        double digit = strtod(expr, &nextChar);
-        data.handle_token(new Token<double>(digit, REAL_Token));
-      }
-
-      expr = nextChar;
+      data.handle_token(rpnBuilder::parseNumber(expr, &expr));
     } else if (rpnBuilder::isvarchar(*expr)) {
       rWordParser_t* parser;
 
       // If the token is a variable, resolve it and
       // add the parsed number to the output queue.
-      std::string key = rpnBuilder::parseVar(expr, &expr);
+      strView_t name = rpnBuilder::scanVar(expr);
+      expr = name.end();
 
-      if ((parser=config.parserMap.find(key)) != nullptr) {
+      if ((parser=config.parserMap.find(name)) != nullptr) {
         // Parse reserved words:
         // try {
         parser(expr, &expr, &data);
@@ -342,7 +842,10 @@ TokenQueue_t calculator::toRPN(const char* expr,
         //   throw;
         // }
       } else {
-        const packToken* value = vars.find(key);
+        // Every key stored on a map is interned, so
+        // names that aren't interned are never found:
+        Symbol key = Symbol::find(name.data, name.size);
+        const packToken* value = key.null() ? 0 : vars.find(key);
 
         if (value) {
           // Save a reference token:
@@ -350,7 +853,7 @@ TokenQueue_t calculator::toRPN(const char* expr,
           data.handle_token(new RefToken(key, copy));
         } else {
           // Save the variable name:
-          data.handle_token(new Token<std::string>(key, VAR_Token));
+          data.handle_token(new Token<std::string>(std::string(name.data, name.size), VAR_Token));
         }
       }
     } else if (*expr == '\'' || *expr == '"') {
@@ -359,25 +862,29 @@ TokenQueue_t calculator::toRPN(const char* expr,
       char quote = *expr;
 
       ++expr;
-      std::stringstream ss;
+      const char* start = expr;
+      while (*expr && *expr != quote && *expr != '\n' && *expr != '\\') ++expr;
+
+      // Strings without escape sequences are copied at once:
+      std::string str(start, expr - start);
       while (*expr && *expr != quote && *expr != '\n') {
         if (*expr == '\\') {
           switch (expr[1]) {
           case 'n':
             expr+=2;
-            ss << '\n';
+            str.push_back('\n');
             break;
           case 't':
             expr+=2;
-            ss << '\t';
+            str.push_back('\t');
             break;
           default:
             if (strchr("\"'\n", expr[1])) ++expr;
-            ss << *expr;
+            str.push_back(*expr);
             ++expr;
           }
         } else {
-          ss << *expr;
+          str.push_back(*expr);
           ++expr;
         }
       }
@@ -386,12 +893,12 @@ TokenQueue_t calculator::toRPN(const char* expr,
         std::string squote = (quote == '"' ? "\"": "'");
         rpnBuilder::cleanRPN(&data.rpn);
         // throw syntax_error("Expected quote (" + squote +
-        //                    ") at end of string declaration: " + squote + ss.str() + ".");
+        //                    ") at end of string declaration: " + squote + str + ".");
         TokenQueue_t queue;
         return queue;
       }
       ++expr;
-      data.handle_token(new Token<std::string>(ss.str(), STR_Token));
+      data.handle_token(new Token<std::string>(std::move(str), STR_Token));
     } else {
       // Otherwise, the variable is an operator or paranthesis.
       switch (*expr) {
@@ -447,43 +954,46 @@ TokenQueue_t calculator::toRPN(const char* expr,
           // Then the token is an operator
 
           const char* start = expr;
-          std::stringstream ss;
-          ss << *expr;
           ++expr;
-          while (*expr && ispunct(*expr) && !strchr("+-'\"()[]{}_", *expr)) {
-            ss << *expr;
-            ++expr;
-          }
-          std::string op = ss.str();
+          while (rpnBuilder::is(*expr, OP_CHAR)) ++expr;
+          strView_t op(start, expr - start);
 
-          // Check if the word parser applies:
-          rWordParser_t* parser = config.parserMap.find(op);
+          // Find the longest reserved word and operator on it:
+          size_t word_size, op_size;
+          rWordParser_t* parser = config.parserMap.longest(op, &word_size);
+          opSymbol_t op_id = data.opp.longest(op, &op_size);
+          rWordParser_t* char_parser = 0;
 
           // Evaluate the meaning of this operator in the following order:
-          // 1. Is there a word parser for it?
+          // 1. Is it a reserved word?
           // 2. Is it a valid operator?
           // 3. Is there a character parser for its first character?
-          if (parser) {
-            // Parse reserved operators:
+          // 4. Does it start with a reserved word or an operator?
+          //    e.g. ">=" on ">=!", then the rest is parsed as the next token.
+          if (word_size < op.size && op_size < op.size &&
+              (char_parser = config.parserMap.find(*start)) != nullptr) {
+            expr = start+1;
             // try {
-              parser(expr, &expr, &data);
+              char_parser(expr, &expr, &data);
             // } catch (...) {
             //   rpnBuilder::cleanRPN(&data.rpn);
             //   throw;
             // }
-          } else if (data.opp.exists(op)) {
-            data.handle_op(op);
-          } else if ((parser = config.parserMap.find(op[0])) != nullptr) {
-            expr = start+1;
+          } else if (parser && word_size >= op_size) {
+            // Parse reserved operators:
+            expr = start + word_size;
             // try {
               parser(expr, &expr, &data);
             // } catch (...) {
             //   rpnBuilder::cleanRPN(&data.rpn);
             //   throw;
             // }
+          } else if (op_id) {
+            expr = start + op_size;
+            data.handle_op(op_id);
           } else {
             rpnBuilder::cleanRPN(&data.rpn);
-            // throw syntax_error("Invalid operator: " + op);
+            // throw syntax_error("Invalid operator: " + op.str());
             TokenQueue_t queue;
             return queue;
           }
@@ -491,7 +1001,7 @@ TokenQueue_t calculator::toRPN(const char* expr,
       }
     }
     // Ignore spaces but stop on delimiter if not inside brackets.
-    while (*expr && isspace(*expr)
+    while (rpnBuilder::is(*expr, SPACE_CHAR)
            && (data.bracketLevel || !strchr(delim, *expr))) ++expr;
   }
 
@@ -503,10 +1013,8 @@ TokenQueue_t calculator::toRPN(const char* expr,
     return queue;
   }
 
-  std::string cur_op;
   while (!data.opStack.empty()) {
-    cur_op = normalize_op(data.opStack.top());
-    data.rpn.push(new Token<std::string>(cur_op, OP_Token));
+    data.rpn.push(new TokenOp(opSymbols::normalize(data.opStack.top())));
     data.opStack.pop();
   }
 
@@ -516,201 +1024,1278 @@ TokenQueue_t calculator::toRPN(const char* expr,
   return data.rpn;
 }
 
-packToken calculator::calculate(const char* expr, const TokenMap &vars,
-                                const char* delim, const char** rest) {
-  // Convert to RPN with Dijkstra's Shunting-yard algorithm.
-  RAII_TokenQueue_t rpn = calculator::toRPN(expr, vars, delim, rest);
-
-  TokenBase* ret = calculator::calculate(rpn, vars);
-  if (ret)
-  {
-    return packToken(resolve_reference(ret));
-  }
-  else
-  {
-    return false;
+namespace cparse {
+namespace {
+
+// A sub-tree of the RPN being folded:
+struct foldNode_t {
+  TokenQueue_t tokens;
+  // Its value if it is a constant:
+  packToken value;
+  bool constant;
+
+  // Only values that cannot be modified by the operations
+  // that use them are replaced on the RPN:
+  static bool scalar(tokType_t type) {
+    switch (type) {
+    case NONE_Token: case STR_Token:
+    case REAL_Token: case INT_Token: case BOOL_Token:
+      return true;
+    default:
+      return false;
+    }
   }
-}
 
-void cleanStack(std::stack<TokenBase*> st) {
-  while (st.size() > 0) {
-    delete resolve_reference(st.top());
-    st.pop();
+  bool foldable() const { return constant && scalar(value->type); }
+
+  // Move its tokens, or its value if it was folded, to `rpn`:
+  void emit(TokenQueue_t* rpn) {
+    if (foldable() && tokens.size() > 1) {
+      rpnBuilder::cleanRPN(&tokens);
+      rpn->push(value->clone());
+    } else {
+      rpn->insert(rpn->end(), tokens.begin(), tokens.end());
+      tokens.clear();
+    }
   }
+};
+
+TokenBase* applyOperator(opSymbol_t op, bool call, Operation::opFunc_t func, uint8_t flags,
+                         TokenBase* l_token, TokenBase* r_token,
+                         evaluationData* data, const opDispatch_t& dispatch);
+
+// If `ref` was read from `vars` as one of the pure builtin
+// functions of TokenMap::default_global():
+bool isPureBuiltin(const RefToken* ref, const TokenMap& vars) {
+  const packToken& value = ref->value();
+  if (value->type != FUNC_Token || !value.asFunc()->pure()) return false;
+
+  const std::string& key = ref->key.asString();
+  const packToken* found = vars.find(key);
+  return found && found == TokenMap::default_global().find(key);
 }
 
-TokenBase* calculator::calculate(const TokenQueue_t& rpn, const TokenMap &scope,
-                                 const Config_t& config) {
-  evaluationData data(rpn, scope, config.opMap);
+}  // namespace
+}  // namespace cparse
 
-  // Evaluate the expression in RPN form.
-  std::stack<TokenBase*> evaluation;
-  while (!data.rpn.empty()) {
-    TokenBase* base = data.rpn.front()->clone();
-    data.rpn.pop();
+void calculator::fold(TokenQueue_t* rpn, const Config_t& config, const TokenMap& vars) {
+  static const opSymbol_t call_op = opSymbols::intern("()");
+  const opDispatch_t& dispatch = config.opMap.dispatch();
+  evaluationData data(TokenMap(), config.opMap);
 
-    // Operator:
-    if (base->type == OP_Token) {
-      data.op = static_cast<Token<std::string>*>(base)->val;
-      delete base;
-
-      /* * * * * Resolve operands Values and References: * * * * */
-
-      if (evaluation.size() < 2) {
-        cleanStack(evaluation);
-        // throw std::domain_error("Invalid equation.");
-        return nullptr;
-      }
-      TokenBase* r_token = evaluation.top(); evaluation.pop();
-      TokenBase* l_token = evaluation.top(); evaluation.pop();
-
-      if (r_token->type & REF_Token) {
-        data.right.reset(static_cast<RefToken*>(r_token));
-        r_token = data.right->resolve(&data.scope);
-      } else if (r_token->type == VAR_Token) {
-        packToken key = static_cast<Token<std::string>*>(r_token)->val;
-        data.right.reset(new RefToken(key));
+  // Make sure the RPN is well formed before taking its tokens:
+  uint32_t depth = 0;
+  for (const TokenBase* base : *rpn) {
+    if (base->type != OP_Token) {
+      ++depth;
+    } else if (depth-- < 2) {
+      return;
+    }
+  }
+  if (depth != 1) return;
+
+  std::vector<foldNode_t> stack;
+  for (TokenBase* base : *rpn) {
+    foldNode_t node;
+
+    if (base->type != OP_Token) {
+      node.tokens.push(base);
+
+      if (base->type & REF_Token) {
+        // Variables are read again from the scope on each evaluation,
+        // so only the pure builtins are bound at compile time:
+        const RefToken* ref = static_cast<RefToken*>(base);
+        node.constant = isPureBuiltin(ref, vars);
+        if (node.constant) node.value = ref->value();
+      } else if (base->type == FUNC_Token) {
+        // Only pure functions are trusted not to change after compile time:
+        node.value = packToken(base->clone());
+        node.constant = static_cast<Function*>(base)->pure();
+      } else {
+        // Containers are never constant since they might be modified in place:
+        node.value = packToken(base->clone());
+        node.constant = base->type == UNARY_Token || foldNode_t::scalar(base->type);
+      }
+      stack.push_back(std::move(node));
+      continue;
+    }
+
+    opSymbol_t op = static_cast<TokenOp*>(base)->op;
+    foldNode_t right = std::move(stack.back()); stack.pop_back();
+    foldNode_t left = std::move(stack.back()); stack.pop_back();
+
+    node.constant = false;
+    Operation::opFunc_t func = nullptr;
+    uint8_t flags = 0;
+    bool call = false;
+    if (left.constant && right.constant) {
+      tokType_t l_type = left.value->type, r_type = right.value->type;
+      if (op == call_op && l_type == FUNC_Token) {
+        node.constant = call = true;
       } else {
-        data.right.reset(new RefToken());
+        func = dispatch.find(op, l_type, r_type, &flags);
+        node.constant = func && (flags & Operation::PURE);
       }
+    }
 
-      if (l_token->type & REF_Token) {
-        data.left.reset(static_cast<RefToken*>(l_token));
-        l_token = data.left->resolve(&data.scope);
-      } else if (l_token->type == VAR_Token) {
-        packToken key = static_cast<Token<std::string>*>(l_token)->val;
-        data.left.reset(new RefToken(key));
+    if (node.constant) {
+      // Evaluate it exactly as it would be evaluated by exec():
+      TokenBase* result = applyOperator(op, call, func, flags, left.value->clone(),
+                                        right.value->clone(), &data, dispatch);
+
+      // References depend on their origin, so they are kept as well:
+      if (result && !(result->type & REF_Token)) {
+        node.value = packToken(result);
       } else {
-        data.left.reset(new RefToken());
+        delete result;
+        node.constant = false;
       }
+    }
 
-      if (l_token->type == FUNC_Token && data.op == "()") {
-        // * * * * * Resolve Function Calls: * * * * * //
+    left.emit(&node.tokens);
+    right.emit(&node.tokens);
+    node.tokens.push(base);
+    stack.push_back(std::move(node));
+  }
 
-        Function* l_func = static_cast<Function*>(l_token);
+  rpn->clear();
+  stack.back().emit(rpn);
+}
 
-        // Collect the parameter tuple:
-        Tuple right;
-        if (r_token->type == TUPLE_Token) {
-          right = *static_cast<Tuple*>(r_token);
-        } else {
-          right = Tuple(r_token);
-        }
-        delete r_token;
+namespace cparse {
+namespace {
+
+// A node of the expression tree used to find common sub-expressions:
+struct cseNode_t {
+  enum action_t : uint8_t { KEEP, SAVE, LOAD };
+
+  // Children of an operator node, or -1 for leaves:
+  int32_t left = -1, right = -1;
+  // Position of the first token of its sub-tree on the RPN:
+  uint32_t begin;
+  // Nodes with the same id have the same structure:
+  uint32_t id;
+  // Number of impure operations evaluated before it:
+  uint32_t epoch = 0;
+  bool pure = true;
+  action_t action = KEEP;
+  uint32_t slot = 0;
+};
 
-        packToken _this;
-        if (data.left->origin->type != NONE_Token) {
-          _this = data.left->origin;
-        } else {
-          _this = data.scope;
-        }
+// Build the key that identifies equal leaves,
+// or return "" if the leaf should never be merged:
+std::string cseLeafKey(const TokenBase* base) {
+  std::stringstream ss;
+  ss.precision(17);
+  ss << base->type << ':';
+
+  switch (base->type) {
+  case NONE_Token: case UNARY_Token:
+    break;
+  case VAR_Token: case STR_Token:
+    ss << static_cast<const Token<std::string>*>(base)->val;
+    break;
+  case REAL_Token:
+    ss << static_cast<const Token<double>*>(base)->val;
+    break;
+  case INT_Token:
+    ss << static_cast<const Token<int64_t>*>(base)->val;
+    break;
+  case BOOL_Token:
+    ss << static_cast<int>(static_cast<const Token<uint8_t>*>(base)->val);
+    break;
+  default:
+    // Variables captured at compile time:
+    if (base->type & REF_Token) {
+      const RefToken* ref = static_cast<const RefToken*>(base);
+      if (ref->origin->type == NONE_Token && ref->key->type == STR_Token) {
+        ss << ref->key.asString();
+        break;
+      }
+    }
+    return "";
+  }
+  return ss.str();
+}
 
-        // Execute the function:
-        packToken ret;
-        // try {
-          ret = Function::call(_this, l_func, &right, data.scope);
-        // } catch (...) {
-        //   cleanStack(evaluation);
-        //   delete l_func;
-        //   throw;
-        // }
+// Calls through references are resolved on the evaluation
+// scope, which might shadow them with impure functions:
+bool isPureFunction(const TokenBase* base) {
+  return base->type == FUNC_Token && static_cast<const Function*>(base)->pure();
+}
 
-        delete l_func;
-        evaluation.push(ret->clone());
+}  // namespace
+}  // namespace cparse
+
+void calculator::cse(TokenQueue_t* rpn, const Config_t& config) {
+  static const opSymbol_t call_op = opSymbols::intern("()");
+  static const opSymbol_t comma_op = opSymbols::intern(",");
+  static const opSymbol_t colon_op = opSymbols::intern(":");
+  const opDispatch_t& dispatch = config.opMap.dispatch();
+
+  // Build the expression tree, giving the same id to equal sub-trees:
+  std::vector<TokenBase*> tokens(rpn->begin(), rpn->end());
+  std::vector<cseNode_t> nodes(tokens.size());
+  std::vector<uint32_t> stack;
+  std::map<std::string, uint32_t> leaf_ids;
+  std::map<std::tuple<opSymbol_t, uint32_t, uint32_t>, uint32_t> op_ids;
+  uint32_t next_id = 0, epoch = 0;
+
+  for (uint32_t i = 0; i < tokens.size(); ++i) {
+    cseNode_t& node = nodes[i];
+    node.begin = i;
+
+    if (tokens[i]->type != OP_Token) {
+      std::string key = cseLeafKey(tokens[i]);
+      if (key.empty()) {
+        node.id = next_id++;
       } else {
-        // * * * * * Resolve All Other Operations: * * * * * //
+        auto it = leaf_ids.insert(std::make_pair(key, next_id)).first;
+        if (it->second == next_id) ++next_id;
+        node.id = it->second;
+      }
+      stack.push_back(i);
+      continue;
+    }
 
-        data.opID = Operation::build_mask(l_token->type, r_token->type);
-        packToken l_pack(l_token);
-        packToken r_pack(r_token);
-        TokenBase* result = 0;
+    // Give up on malformed expressions:
+    if (stack.size() < 2) return;
+    node.right = stack.back(); stack.pop_back();
+    node.left = stack.back(); stack.pop_back();
+    node.begin = nodes[node.left].begin;
 
-        // try {
-          // Resolve the operation:
-          result = exec_operation(l_pack, r_pack, &data, data.op);
-          if (!result) {
-            result = exec_operation(l_pack, r_pack, &data, ANY_OP);
-          }
-        // } catch (...) {
-        //   cleanStack(evaluation);
-        //   throw;
-        // }
+    opSymbol_t op = static_cast<TokenOp*>(tokens[i])->op;
+    auto key = std::make_tuple(op, nodes[node.left].id, nodes[node.right].id);
+    auto it = op_ids.insert(std::make_pair(key, next_id)).first;
+    if (it->second == next_id) ++next_id;
+    node.id = it->second;
 
-        if (result) {
-          evaluation.push(result);
-        } else {
-          cleanStack(evaluation);
-          return nullptr;
-          // throw undefined_operation(data.op, l_pack, r_pack);
-        }
-      }
-    } else if (base->type == VAR_Token) {  // Variable
-      packToken* value = NULL;
-      std::string key = static_cast<Token<std::string>*>(base)->val;
+    if (op == call_op) {
+      node.pure = isPureFunction(tokens[node.left]) && nodes[node.right].pure;
+    } else {
+      node.pure = dispatch.isPure(op) && nodes[node.left].pure && nodes[node.right].pure;
+    }
 
-      value = data.scope.find(key);
+    // A sub-tree has the same value wherever it appears
+    // as long as no side effect happens in between:
+    node.epoch = epoch;
+    if (!node.pure) ++epoch;
 
-      if (value) {
-        TokenBase* copy = (*value)->clone();
-        evaluation.push(new RefToken(key, copy));
-        delete base;
-      } else {
-        evaluation.push(base);
+    stack.push_back(i);
+  }
+  if (stack.size() != 1) return;
+
+  auto candidate = [&](uint32_t i) {
+    if (!nodes[i].pure || nodes[i].left < 0) return false;
+    opSymbol_t op = static_cast<TokenOp*>(tokens[i])->op;
+    return op != comma_op && op != colon_op;
+  };
+
+  // Walk the tree on evaluation order, marking the repeated sub-trees.
+  // The ones that are loaded are not visited since they are never evaluated:
+  std::map<std::pair<uint32_t, uint32_t>, uint32_t> first;
+  std::vector<uint32_t> pending(1, stack.back());
+  while (!pending.empty()) {
+    uint32_t i = pending.back();
+    pending.pop_back();
+
+    if (candidate(i)) {
+      auto key = std::make_pair(nodes[i].id, nodes[i].epoch);
+      auto it = first.insert(std::make_pair(key, i)).first;
+      if (it->second != i) {
+        nodes[it->second].action = cseNode_t::SAVE;
+        nodes[i].action = cseNode_t::LOAD;
+        continue;
       }
-    } else {
-      evaluation.push(base);
+    }
+
+    if (nodes[i].left >= 0) {
+      pending.push_back(nodes[i].right);
+      pending.push_back(nodes[i].left);
     }
   }
-  
-  if (evaluation.empty())
-  {
-    return nullptr;
+
+  // Number the slots on the order they are saved:
+  uint32_t slots = 0;
+  for (cseNode_t& node : nodes) {
+    if (node.action == cseNode_t::SAVE) node.slot = slots++;
   }
-  else
-  {
-    return evaluation.top();
+  if (slots == 0) return;
+
+  for (uint32_t i = 0; i < nodes.size(); ++i) {
+    if (nodes[i].action == cseNode_t::LOAD) {
+      auto key = std::make_pair(nodes[i].id, nodes[i].epoch);
+      nodes[i].slot = nodes[first[key]].slot;
+    }
   }
-}
 
-/* * * * * Non Static Functions * * * * */
+  // Rewrite the RPN:
+  std::vector<bool> loaded(tokens.size(), false);
+  for (uint32_t i = 0; i < nodes.size(); ++i) {
+    if (nodes[i].action == cseNode_t::LOAD) {
+      std::fill(loaded.begin() + nodes[i].begin, loaded.begin() + i, true);
+    }
+  }
 
-calculator::~calculator() {
-  rpnBuilder::cleanRPN(&this->RPN);
+  rpn->clear();
+  for (uint32_t i = 0; i < tokens.size(); ++i) {
+    if (loaded[i]) {
+      delete tokens[i];
+    } else if (nodes[i].action == cseNode_t::LOAD) {
+      delete tokens[i];
+      rpn->push(new TokenSlot(nodes[i].slot, false));
+    } else {
+      rpn->push(tokens[i]);
+      if (nodes[i].action == cseNode_t::SAVE) {
+        rpn->push(new TokenSlot(nodes[i].slot, true));
+      }
+    }
+  }
 }
 
-calculator::calculator(const calculator& calc) {
-  TokenQueue_t _rpn = calc.RPN;
+packToken calculator::calculate(const char* expr, const TokenMap &vars,
+                                const char* delim, const char** rest, bool cached) {
+  std::shared_ptr<const Program> program;
+  if (cached && !delim) program = cache().get(expr, rest, Default());
 
-  // Deep copy the token list, so everything can be
-  // safely deallocated:
-  while (!_rpn.empty()) {
-    TokenBase* base = _rpn.front();
-    _rpn.pop();
-    this->RPN.push(base->clone());
+  TokenBase* ret;
+  if (program) {
+    ret = program->exec(vars, Default());
+  } else {
+    // Convert to RPN with Dijkstra's Shunting-yard algorithm.
+    RAII_TokenQueue_t rpn = calculator::toRPN(expr, vars, delim, rest);
+    ret = calculator::calculate(rpn, vars);
   }
-}
 
-// Work as a sub-parser:
-// - Stops at delim or '\0'
-// - Returns the rest of the string as char* rest
+  if (ret)
+  {
+    return packToken(resolve_reference(ret));
+  }
+  else
+  {
+    return false;
+  }
+}
+
+TokenBase* calculator::calculate(const TokenQueue_t& rpn, const TokenMap &scope,
+                                 const Config_t& config) {
+  return Program::compile(rpn, config).exec(scope, config);
+}
+
+ProgramCache& calculator::cache() {
+  static ProgramCache cache;
+  return cache;
+}
+
+/* * * * * ProgramCache class * * * * */
+
+std::shared_ptr<const Program> ProgramCache::get(const char* expr, const char** rest,
+                                                 const Config_t& config) {
+  // The config is identified by its address and current generation:
+  const Config_t* id = &config;
+  std::string key(reinterpret_cast<const char*>(&id), sizeof(id));
+  key += config.generation();
+  key += expr;
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (_capacity == 0) return nullptr;
+
+    auto it = index.find(key);
+    if (it != index.end()) {
+      ++_stats.hits;
+      entries.splice(entries.begin(), entries, it->second);
+      if (rest) *rest = expr + it->second->size;
+      return it->second->program;
+    }
+    ++_stats.misses;
+  }
+
+  // Compile it without holding the lock, on an empty scope:
+  const char* end;
+  TokenMap scope(0);
+  calculator::RAII_TokenQueue_t rpn = calculator::toRPN(expr, scope, 0, &end, config);
+  std::shared_ptr<const Program> program = std::make_shared<Program>(Program::compile(rpn, config));
+  if (rest) *rest = end;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if (_capacity == 0 || index.count(key)) return program;
+
+  entries.push_front(entry_t{key, program, static_cast<size_t>(end - expr)});
+  index[key] = entries.begin();
+  evict();
+  return program;
+}
+
+// Must be called with the mutex locked:
+void ProgramCache::evict() {
+  while (entries.size() > _capacity) {
+    index.erase(entries.back().key);
+    entries.pop_back();
+    ++_stats.evictions;
+  }
+}
+
+void ProgramCache::set_capacity(size_t capacity) {
+  std::lock_guard<std::mutex> lock(mutex);
+  _capacity = capacity;
+  evict();
+}
+
+size_t ProgramCache::capacity() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return _capacity;
+}
+
+size_t ProgramCache::size() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return entries.size();
+}
+
+ProgramCache::stats_t ProgramCache::stats() const {
+  std::lock_guard<std::mutex> lock(mutex);
+  return _stats;
+}
+
+void ProgramCache::clear() {
+  std::lock_guard<std::mutex> lock(mutex);
+  entries.clear();
+  index.clear();
+}
+
+/* * * * * Program class * * * * */
+
+namespace cparse {
+namespace {
+
+// Type of the numbers Program::exec_numeric() can work with, i.e.
+// the types below NUM_Token on the tokType lattice, or NONE_Token:
+inline tokType_t numeralType(const TokenBase* base) {
+  if (base->type & REF_Token) {
+    base = static_cast<const RefToken*>(base)->value().token();
+  }
+  switch (base->type) {
+  case REAL_Token: case INT_Token: case BOOL_Token:
+    return base->type;
+  default:
+    return NONE_Token;
+  }
+}
+
+inline double numeralValue(const TokenBase* base) {
+  switch (base->type) {
+  case REAL_Token:
+    return static_cast<const Token<double>*>(base)->val;
+  case INT_Token:
+    return static_cast<const Token<int64_t>*>(base)->val;
+  default:
+    return static_cast<const Token<uint8_t>*>(base)->val;
+  }
+}
+
+// Resolve a reference read by a numeric evaluation
+// the same way RefToken::resolve() does:
+inline const TokenBase* numeralRef(const TokenBase* base, const TokenMap& scope) {
+  const RefToken* ref = static_cast<const RefToken*>(base);
+  const packToken* value = 0;
+  if (ref->origin->type == NONE_Token && ref->key->type == STR_Token) {
+    value = scope.find(ref->key.asString());
+  }
+  return value ? value->token() : ref->value().token();
+}
+
+}  // namespace
+}  // namespace cparse
+
+Program Program::compile(const TokenQueue_t& rpn, const Config_t& config) {
+  static const opSymbol_t call_op = opSymbols::intern("()");
+  const opDispatch_t& dispatch = config.opMap.dispatch();
+  Program program;
+  std::map<std::string, uint32_t> names;
+  uint32_t depth = 0;
+
+  // The instruction that pushed each value on the stack, or -1
+  // if it was produced by an operation:
+  std::vector<int32_t> producers;
+
+  // Infer whether every value on the stack is a number:
+  bool numeric = true;
+
+  for (const TokenBase* base : rpn) {
+    if (base->type == SLOT_Token) {
+      const TokenSlot* slot = static_cast<const TokenSlot*>(base);
+      program.code.push_back(Instruction(slot->save ? SAVE_SLOT : LOAD_SLOT, slot->slot));
+      if (slot->slot >= program.slots) program.slots = slot->slot + 1;
+
+      // Saving keeps the value on the stack:
+      if (!slot->save) {
+        if (++depth > program.depth) program.depth = depth;
+        producers.push_back(-1);
+      }
+    } else if (base->type == OP_Token) {
+      opSymbol_t op = static_cast<const TokenOp*>(base)->op;
+      program.code.push_back(Instruction(op == call_op ? CALL_OP : APPLY_OP, op));
+      numeric = numeric && op != call_op && depth >= 2;
+
+      // Each operator consumes 2 values and produces 1:
+      if (depth) --depth;
+      for (int i = 0; i < 2 && !producers.empty(); ++i) {
+        if (producers.back() >= 0 && !dispatch.usesRefs(op)) {
+          program.code[producers.back()].ref = false;
+        }
+        producers.pop_back();
+      }
+      producers.push_back(-1);
+    } else {
+      producers.push_back(program.code.size());
+      if (base->type == VAR_Token) {
+        const std::string& key = static_cast<const Token<std::string>*>(base)->val;
+
+        auto it = names.find(key);
+        if (it == names.end()) {
+          it = names.insert(std::make_pair(key, program.names.size())).first;
+          program.names.push_back(Symbol(key));
+        }
+        program.code.push_back(Instruction(PUSH_VAR, it->second));
+      } else {
+        program.code.push_back(Instruction(PUSH_CONST, program.constants.size()));
+        program.constants.push_back(packToken(base->clone()));
+        numeric = numeric && (base->type == UNARY_Token || numeralType(base) != NONE_Token);
+      }
+
+      if (++depth > program.depth) program.depth = depth;
+    }
+  }
+
+  program.numeric = numeric && depth == 1 && program.code.size() > 1 &&
+                    program.depth <= MAX_NUMERIC_DEPTH &&
+                    program.slots <= MAX_NUMERIC_DEPTH;
+  program.inferred_numeric = program.numeric;
+
+  // Programs are long lived, so release the unused capacity:
+  program.code.shrink_to_fit();
+  program.constants.shrink_to_fit();
+  program.names.shrink_to_fit();
+  return program;
+}
+
+void Program::bind(const Schema& schema) {
+  // Undo the previous binding, the names of the
+  // bound variables are kept on `names`:
+  for (Instruction& inst : this->code) {
+    if (inst.code == PUSH_ARG) {
+      const Symbol& name = this->args[inst.arg];
+      inst.code = PUSH_VAR;
+      inst.arg = std::find(this->names.begin(), this->names.end(), name) - this->names.begin();
+    }
+  }
+  this->numeric = this->inferred_numeric;
+
+  this->args.clear();
+  for (const Schema::field_t& field : schema.fields) {
+    this->args.push_back(Symbol(field.name));
+  }
+
+  for (Instruction& inst : this->code) {
+    int32_t slot;
+    if (inst.code == PUSH_VAR && (slot = schema.find(this->names[inst.arg])) >= 0) {
+      inst.code = PUSH_ARG;
+      inst.arg = slot;
+
+      // Don't try the numeric evaluation on variables known not to be numbers:
+      if (!(schema.fields[slot].type & NUM_Token)) this->numeric = false;
+    }
+  }
+}
+
+std::string Program::str() const {
+  std::stringstream ss;
+  for (size_t i = 0; i < this->code.size(); ++i) {
+    const Instruction& inst = this->code[i];
+    ss << (i ? ", " : "");
+
+    switch (inst.code) {
+    case PUSH_CONST:
+      ss << packToken(resolve_reference(this->constants[inst.arg]->clone())).str();
+      break;
+    case PUSH_VAR:
+      ss << this->names[inst.arg];
+      break;
+    case PUSH_ARG:
+      ss << this->args[inst.arg];
+      break;
+    case SAVE_SLOT:
+      ss << "save #" << inst.arg;
+      break;
+    case LOAD_SLOT:
+      ss << "load #" << inst.arg;
+      break;
+    default:
+      ss << opSymbols::name(inst.arg);
+    }
+  }
+  return ss.str();
+}
+
+namespace cparse {
+namespace {
+
+// Find the value of the schema slot `i`:
+const packToken* findArg(const std::vector<Symbol>& names, uint32_t i,
+                         const packToken* args, const TokenMap& scope) {
+  return args ? &args[i] : scope.find(names[i]);
+}
+
+}  // namespace
+}  // namespace cparse
+
+TokenBase* Program::exec_numeric(const TokenMap& scope, const opDispatch_t& dispatch,
+                                 const packToken* args) const {
+  struct number_t {
+    double value;
+    tokType_t type;
+  } stack[MAX_NUMERIC_DEPTH], slots[MAX_NUMERIC_DEPTH];
+  uint32_t top = 0;
+
+  for (const Instruction& inst : this->code) {
+    const TokenBase* base;
+
+    switch (inst.code) {
+    case PUSH_CONST:
+      base = this->constants[inst.arg].token();
+      if (base->type == UNARY_Token) {
+        stack[top++] = {0, UNARY_Token};
+        continue;
+      }
+
+      if (base->type & REF_Token) base = numeralRef(base, scope);
+      break;
+    case PUSH_VAR:
+      {
+        const packToken* value = scope.find(this->names[inst.arg]);
+        if (!value) return nullptr;
+        base = value->token();
+      }
+      break;
+    case PUSH_ARG:
+      {
+        const packToken* value = findArg(this->args, inst.arg, args, scope);
+        if (!value) return nullptr;
+        base = value->token();
+      }
+      break;
+    case SAVE_SLOT:
+      slots[inst.arg] = stack[top-1];
+      continue;
+    case LOAD_SLOT:
+      stack[top++] = slots[inst.arg];
+      continue;
+    default:
+      {
+        number_t& left = stack[top-2];
+        number_t& right = stack[--top];
+        const batchKernel_t* kernel = dispatch.findBatch(inst.arg, left.type, right.type);
+        if (!kernel) return nullptr;
+
+        kernel->func(&left.value, &right.value, &left.value, 1);
+        left.type = kernel->type;
+      }
+      continue;
+    }
+
+    tokType_t type = numeralType(base);
+    if (type == NONE_Token) return nullptr;
+    stack[top++] = {numeralValue(base), type};
+  }
+
+  if (stack[0].type == BOOL_Token) {
+    return new Token<uint8_t>(stack[0].value != 0, BOOL_Token);
+  } else if (stack[0].type == REAL_Token) {
+    return new Token<double>(stack[0].value, REAL_Token);
+  }
+  return nullptr;
+}
+
+void cleanStack(std::vector<TokenBase*>* st) {
+  for (TokenBase* base : *st) {
+    delete resolve_reference(base);
+  }
+  st->clear();
+}
+
+namespace cparse {
+namespace {
+
+// Build the reference an operation expects for an operand that
+// is not a RefToken, i.e. a plain value or an undefined variable:
+RefToken* makeRef(const TokenBase* token, Arena* arena) {
+  if (token->type == VAR_Token) {
+    packToken key = Token<std::string>(static_cast<const Token<std::string>*>(token)->val, STR_Token);
+    return new (arena) RefToken(key);
+  }
+  return new (arena) RefToken();
+}
+
+// Apply the operator `op` to 2 operands taken from the stack, which
+// are owned by this function. `func` is the operation bound at compile
+// time, if any, and `flags` its flags. Returns the result or nullptr
+// if the operation failed.
+TokenBase* applyOperator(opSymbol_t op, bool call, Operation::opFunc_t func, uint8_t flags,
+                         TokenBase* l_token, TokenBase* r_token,
+                         evaluationData* data, const opDispatch_t& dispatch) {
+  data->op = opSymbols::name(op);
+
+  /* * * * * Resolve operands Values and References: * * * * */
+
+  if (r_token->type & REF_Token) {
+    data->right.reset(static_cast<RefToken*>(r_token));
+    r_token = data->right->resolve(&data->scope, data->arena);
+  } else {
+    data->right.reset();
+  }
+
+  if (l_token->type & REF_Token) {
+    data->left.reset(static_cast<RefToken*>(l_token));
+    l_token = data->left->resolve(&data->scope, data->arena);
+  } else {
+    data->left.reset();
+  }
+
+  if (l_token->type == FUNC_Token && call) {
+    // * * * * * Resolve Function Calls: * * * * * //
+
+    Function* l_func = static_cast<Function*>(l_token);
+
+    // Read the arguments in place from the parameter tuple:
+    packToken right(r_token);
+    const packToken* argv = &right;
+    size_t argc = 1;
+    if (r_token->type == TUPLE_Token) {
+      const TokenList_t& list = static_cast<Tuple*>(r_token)->list();
+      argv = list.data();
+      argc = list.size();
+    }
+
+    // Methods are called with their object, other
+    // functions with the caller scope:
+    const packToken* _this = 0;
+    if (data->left && data->left->origin->type != NONE_Token) {
+      _this = &data->left->origin;
+    }
+
+    // Execute the function:
+    packToken ret;
+    // try {
+      ret = Function::call(_this, l_func, argv, argc, data->scope, data->arena);
+    // } catch (...) {
+    //   delete l_func;
+    //   throw;
+    // }
+
+    delete l_func;
+    return std::move(ret).release();
+  }
+
+  // * * * * * Resolve All Other Operations: * * * * * //
+
+  data->opID = Operation::build_mask(l_token->type, r_token->type);
+  if (!func) func = dispatch.find(op, l_token->type, r_token->type, &flags);
+
+  // Only build the references of plain values if the operation reads them:
+  if (!(flags & Operation::NO_REFS)) {
+    if (!data->left) data->left.reset(makeRef(l_token, data->arena));
+    if (!data->right) data->right.reset(makeRef(r_token, data->arena));
+  }
+
+  packToken l_pack(l_token);
+  packToken r_pack(r_token);
+
+  // Resolve the operation:
+  if (func) {
+    return func(l_pack, r_pack, data).release();
+  }
+
+  // throw undefined_operation(data->op, l_pack, r_pack);
+  return nullptr;
+}
+
+// Make sure a result allocated from `arena` outlives it:
+TokenBase* promote(TokenBase* result, const Arena* arena) {
+  if (!arena || !arena->owns(result)) return result;
+
+  TokenBase* copy = result->clone();
+  delete result;
+  return copy;
+}
+
+}  // namespace
+}  // namespace cparse
+
+TokenBase* Program::exec(const TokenMap& scope, const Config_t& config, Arena* arena,
+                         const packToken* args) const {
+  const opDispatch_t& dispatch = config.opMap.dispatch();
+
+  // Try first to evaluate it without boxing the intermediate values:
+  if (this->numeric) {
+    TokenBase* result = exec_numeric(scope, dispatch, args);
+    if (result) return result;
+  }
+
+  evaluationData data(scope, config.opMap);
+  data.arena = arena;
+
+  // Evaluate the program:
+  std::vector<TokenBase*> evaluation;
+  evaluation.reserve(this->depth);
+  std::vector<packToken> slots(this->slots);
+  for (const Instruction& inst : this->code) {
+    if (inst.code == PUSH_CONST) {
+      const TokenBase* base = this->constants[inst.arg].token();
+      if (!inst.ref && (base->type & REF_Token)) {
+        evaluation.push_back(static_cast<const RefToken*>(base)->resolve(&data.scope, arena));
+      } else {
+        evaluation.push_back(clone(base, arena));
+      }
+      continue;
+    }
+
+    if (inst.code == SAVE_SLOT) {
+      slots[inst.arg] = packToken(*evaluation.back());
+      continue;
+    }
+
+    if (inst.code == LOAD_SLOT) {
+      evaluation.push_back(slots[inst.arg]->clone());
+      continue;
+    }
+
+    if (inst.code == PUSH_VAR || inst.code == PUSH_ARG) {  // Variable
+      const packToken* value;
+      const Symbol* key;
+      if (inst.code == PUSH_VAR) {
+        key = &this->names[inst.arg];
+        value = data.scope.find(*key);
+      } else {
+        key = &this->args[inst.arg];
+        value = findArg(this->args, inst.arg, args, data.scope);
+      }
+
+      if (value && !inst.ref) {
+        evaluation.push_back(clone(value->token(), arena));
+      } else if (value) {
+        TokenBase* copy = clone(value->token(), arena);
+        evaluation.push_back(new (arena) RefToken(*key, copy));
+      } else {
+        evaluation.push_back(new (arena) Token<std::string>(*key, VAR_Token));
+      }
+      continue;
+    }
+
+    // Operator:
+    if (evaluation.size() < 2) {
+      cleanStack(&evaluation);
+      // throw std::domain_error("Invalid equation.");
+      return nullptr;
+    }
+    TokenBase* r_token = evaluation.back(); evaluation.pop_back();
+    TokenBase* l_token = evaluation.back(); evaluation.pop_back();
+
+    TokenBase* result = applyOperator(inst.arg, inst.code == CALL_OP, nullptr, 0,
+                                      l_token, r_token, &data, dispatch);
+    if (result) {
+      evaluation.push_back(result);
+    } else {
+      cleanStack(&evaluation);
+      return nullptr;
+    }
+  }
+
+  if (evaluation.empty()) {
+    return nullptr;
+  }
+
+  TokenBase* result = evaluation.back();
+  evaluation.pop_back();
+  cleanStack(&evaluation);
+  return promote(result, arena);
+}
+
+/* * * * * ClosureProgram class * * * * */
+
+namespace cparse {
+
+// The state of one ClosureProgram::exec() call:
+struct closureContext_t {
+  const ClosureProgram& program;
+  evaluationData data;
+  const opDispatch_t& dispatch;
+  const packToken* args;
+  std::vector<packToken> slots;
+  // If the operations bound at compile time are still valid:
+  bool bound;
+
+  struct number_t {
+    double value;
+    tokType_t type;
+  } numeric_slots[Program::MAX_NUMERIC_DEPTH];
+
+  closureContext_t(const ClosureProgram& program, const TokenMap& scope,
+                   const Config_t& config, const packToken* args)
+    : program(program), data(scope, config.opMap),
+      dispatch(config.opMap.dispatch()), args(args), slots(program.slots),
+      bound(program.generation == config.opMap.generation()) {}
+
+  const packToken& constant(uint32_t i) const { return program.constants[i]; }
+
+  // The name of the variable read by a PUSH_VAR or PUSH_ARG node:
+  template <opCode_t CODE>
+  const Symbol& name(uint32_t i) const {
+    return CODE == PUSH_VAR ? program.names[i] : program.args[i];
+  }
+
+  template <opCode_t CODE>
+  const packToken* find(uint32_t i) const {
+    if (CODE == PUSH_VAR) return data.scope.find(program.names[i]);
+    return findArg(program.args, i, args, data.scope);
+  }
+};
+
+namespace {
+
+TokenBase* evalConst(const ClosureNode* node, closureContext_t* ctx) {
+  return clone(ctx->constant(node->arg).token(), ctx->data.arena);
+}
+
+TokenBase* evalConstValue(const ClosureNode* node, closureContext_t* ctx) {
+  const RefToken* ref = static_cast<const RefToken*>(ctx->constant(node->arg).token());
+  return ref->resolve(&ctx->data.scope, ctx->data.arena);
+}
+
+template <opCode_t CODE>
+TokenBase* evalVarValue(const ClosureNode* node, closureContext_t* ctx) {
+  const Symbol& key = ctx->name<CODE>(node->arg);
+  const packToken* value = ctx->find<CODE>(node->arg);
+
+  if (value) {
+    return clone(value->token(), ctx->data.arena);
+  } else {
+    return new (ctx->data.arena) Token<std::string>(key, VAR_Token);
+  }
+}
+
+template <opCode_t CODE>
+TokenBase* evalVar(const ClosureNode* node, closureContext_t* ctx) {
+  const Symbol& key = ctx->name<CODE>(node->arg);
+  const packToken* value = ctx->find<CODE>(node->arg);
+
+  Arena* arena = ctx->data.arena;
+  if (value) {
+    return new (arena) RefToken(key, clone(value->token(), arena));
+  } else {
+    return new (arena) Token<std::string>(key, VAR_Token);
+  }
+}
+
+template <bool CALL>
+TokenBase* evalOp(const ClosureNode* node, closureContext_t* ctx) {
+  TokenBase* l_token = node->left->eval(node->left, ctx);
+  if (!l_token) return nullptr;
+
+  TokenBase* r_token = node->right->eval(node->right, ctx);
+  if (!r_token) {
+    delete resolve_reference(l_token);
+    return nullptr;
+  }
+
+  if (!ctx->bound) {
+    return applyOperator(node->arg, CALL, nullptr, 0, l_token, r_token,
+                         &ctx->data, ctx->dispatch);
+  }
+  return applyOperator(node->arg, CALL, node->func, node->flags, l_token, r_token,
+                       &ctx->data, ctx->dispatch);
+}
+
+TokenBase* evalSave(const ClosureNode* node, closureContext_t* ctx) {
+  TokenBase* value = node->left->eval(node->left, ctx);
+  if (value) ctx->slots[node->arg] = packToken(*value);
+  return value;
+}
+
+TokenBase* evalLoad(const ClosureNode* node, closureContext_t* ctx) {
+  return ctx->slots[node->arg]->clone();
+}
+
+/* * * * * Unboxed numeric evaluation: * * * * */
+
+bool numericValue(const TokenBase* base, double* value, tokType_t* type) {
+  *type = numeralType(base);
+  if (*type == NONE_Token) return false;
+  *value = numeralValue(base);
+  return true;
+}
+
+bool numConst(const ClosureNode* node, closureContext_t* ctx,
+              double* value, tokType_t* type) {
+  const TokenBase* base = ctx->constant(node->arg).token();
+  if (base->type == UNARY_Token) {
+    *value = 0;
+    *type = UNARY_Token;
+    return true;
+  }
+
+  if (base->type & REF_Token) base = numeralRef(base, ctx->data.scope);
+  return numericValue(base, value, type);
+}
+
+template <opCode_t CODE>
+bool numVar(const ClosureNode* node, closureContext_t* ctx,
+            double* value, tokType_t* type) {
+  const packToken* found = ctx->find<CODE>(node->arg);
+  return found && numericValue(found->token(), value, type);
+}
+
+bool numOp(const ClosureNode* node, closureContext_t* ctx,
+           double* value, tokType_t* type) {
+  double right;
+  tokType_t r_type;
+  if (!node->left->eval_numeric(node->left, ctx, value, type) ||
+      !node->right->eval_numeric(node->right, ctx, &right, &r_type)) {
+    return false;
+  }
+
+  const batchKernel_t* kernel = ctx->dispatch.findBatch(node->arg, *type, r_type);
+  if (!kernel) return false;
+
+  kernel->func(value, &right, value, 1);
+  *type = kernel->type;
+  return true;
+}
+
+bool numSave(const ClosureNode* node, closureContext_t* ctx,
+             double* value, tokType_t* type) {
+  if (!node->left->eval_numeric(node->left, ctx, value, type)) return false;
+  ctx->numeric_slots[node->arg] = {*value, *type};
+  return true;
+}
+
+bool numLoad(const ClosureNode* node, closureContext_t* ctx,
+             double* value, tokType_t* type) {
+  *value = ctx->numeric_slots[node->arg].value;
+  *type = ctx->numeric_slots[node->arg].type;
+  return true;
+}
+
+}  // namespace
+}  // namespace cparse
+
+ClosureProgram& ClosureProgram::operator=(const ClosureProgram& other) {
+  nodes = other.nodes;
+  constants = other.constants;
+  names = other.names;
+  args = other.args;
+  slots = other.slots;
+  numeric = other.numeric;
+  generation = other.generation;
+
+  // Make the children point to the copied nodes:
+  for (ClosureNode& node : nodes) {
+    if (node.left) node.left = nodes.data() + (node.left - other.nodes.data());
+    if (node.right) node.right = nodes.data() + (node.right - other.nodes.data());
+  }
+  return *this;
+}
+
+ClosureProgram ClosureProgram::compile(const Program& program, const Config_t& config) {
+  const opDispatch_t& dispatch = config.opMap.dispatch();
+  ClosureProgram closures;
+  closures.constants = program.constants;
+  closures.names = program.names;
+  closures.args = program.args;
+  closures.slots = program.slots;
+  closures.numeric = program.numeric;
+  closures.generation = config.opMap.generation();
+
+  // The nodes are never moved after the children are linked:
+  closures.nodes.reserve(program.code.size());
+
+  // Build the tree from the bottom up:
+  std::vector<ClosureNode*> stack;
+  for (const Instruction& inst : program.code) {
+    ClosureNode node;
+    node.arg = inst.arg;
+
+    switch (inst.code) {
+    case PUSH_CONST:
+      node.eval = &evalConst;
+      if (!inst.ref && (program.constants[inst.arg]->type & REF_Token)) {
+        node.eval = &evalConstValue;
+      }
+      node.eval_numeric = &numConst;
+      break;
+    case PUSH_VAR:
+      node.eval = inst.ref ? &evalVar<PUSH_VAR> : &evalVarValue<PUSH_VAR>;
+      node.eval_numeric = &numVar<PUSH_VAR>;
+      break;
+    case PUSH_ARG:
+      node.eval = inst.ref ? &evalVar<PUSH_ARG> : &evalVarValue<PUSH_ARG>;
+      node.eval_numeric = &numVar<PUSH_ARG>;
+      break;
+    case LOAD_SLOT:
+      node.eval = &evalLoad;
+      node.eval_numeric = &numLoad;
+      break;
+    case SAVE_SLOT:
+      // Replaces the node on top of the stack:
+      if (stack.empty()) return ClosureProgram();
+      node.eval = &evalSave;
+      node.eval_numeric = &numSave;
+      node.left = stack.back();
+      stack.pop_back();
+      break;
+    default:
+      if (stack.size() < 2) return ClosureProgram();
+      node.eval_numeric = &numOp;
+      node.right = stack.back(); stack.pop_back();
+      node.left = stack.back(); stack.pop_back();
+      if (inst.code == CALL_OP) {
+        node.eval = &evalOp<true>;
+      } else {
+        node.eval = &evalOp<false>;
+        node.func = dispatch.findUnique(inst.arg, &node.flags);
+      }
+    }
+
+    closures.nodes.push_back(node);
+    stack.push_back(&closures.nodes.back());
+  }
+
+  if (stack.size() != 1) return ClosureProgram();
+  return closures;
+}
+
+TokenBase* ClosureProgram::exec(const TokenMap& scope, const Config_t& config,
+                                Arena* arena, const packToken* args) const {
+  // The root is always the last node:
+  if (nodes.empty()) return nullptr;
+
+  closureContext_t ctx(*this, scope, config, args);
+  ctx.data.arena = arena;
+  const ClosureNode* root = &nodes.back();
+
+  // Try first to evaluate it without boxing the intermediate values:
+  if (this->numeric) {
+    double value;
+    tokType_t type;
+    if (root->eval_numeric(root, &ctx, &value, &type)) {
+      if (type == BOOL_Token) {
+        return new Token<uint8_t>(value != 0, BOOL_Token);
+      } else if (type == REAL_Token) {
+        return new Token<double>(value, REAL_Token);
+      }
+    }
+  }
+
+  TokenBase* result = root->eval(root, &ctx);
+  return result ? promote(result, arena) : nullptr;
+}
+
+/* * * * * Non Static Functions * * * * */
+
+std::shared_ptr<const calculator::Compiled>
+calculator::assemble(Program program, const Schema& schema, engine_t engine,
+                     const Config_t& config) {
+  std::shared_ptr<Compiled> result = std::make_shared<Compiled>();
+  result->program = std::move(program);
+  result->schema = schema;
+  result->program.bind(schema);
+  if (engine == CLOSURES) {
+    result->closures = ClosureProgram::compile(result->program, config);
+  }
+  return result;
+}
+
+const std::shared_ptr<const calculator::Compiled>& calculator::none() {
+  static std::shared_ptr<const Compiled> none = [] {
+    RAII_TokenQueue_t rpn;
+    rpn.push(new TokenNone());
+    return assemble(Program::compile(rpn, Default()), Schema(), INTERPRETER, Default());
+  }();
+  return none;
+}
+
+// Build a new Compiled expression from a copy of the current Program:
+void calculator::rebuild(const Schema& schema, engine_t engine) {
+  this->compiled = assemble(this->compiled->program, schema, engine, Config());
+}
+
+calculator::~calculator() {}
+
+calculator::calculator(const calculator& calc)
+    : compiled(calc.compiled), engine(calc.engine) {}
+
+// The moved-from calculator is left empty:
+calculator::calculator(calculator&& calc)
+    : compiled(std::move(calc.compiled)), engine(calc.engine) {
+  calc.compiled = none();
+  calc.engine = INTERPRETER;
+}
+
+// Work as a sub-parser:
+// - Stops at delim or '\0'
+// - Returns the rest of the string as char* rest
 calculator::calculator(const char* expr, TokenMap vars, const char* delim,
                        const char** rest, const Config_t& config) {
-  this->RPN = calculator::toRPN(expr, vars, delim, rest, config);
+  RAII_TokenQueue_t rpn = calculator::toRPN(expr, vars, delim, rest, config);
+  calculator::fold(&rpn, config, vars);
+  calculator::cse(&rpn, config);
+  this->compiled = assemble(Program::compile(rpn, config), Schema(), INTERPRETER, config);
 }
 
 void calculator::compile(const char* expr, TokenMap &vars, const char* delim,
                          const char** rest) {
-  // Make sure it is empty:
-  rpnBuilder::cleanRPN(&this->RPN);
+  // Build a new Compiled expression and swap it in, so the
+  // calculators sharing the previous one are not affected:
+  RAII_TokenQueue_t rpn = calculator::toRPN(expr, vars, delim, rest, Config());
+  calculator::fold(&rpn, Config(), vars);
+  calculator::cse(&rpn, Config());
+  this->compiled = assemble(Program::compile(rpn, Config()), this->compiled->schema,
+                            this->engine, Config());
+}
 
-  this->RPN = calculator::toRPN(expr, vars, delim, rest, Config());
+void calculator::set_engine(engine_t engine) {
+  if (engine == CLOSURES && this->engine != CLOSURES) {
+    rebuild(this->compiled->schema, engine);
+  }
+  this->engine = engine;
+}
+
+void calculator::bind(const Schema& schema) {
+  rebuild(schema, this->engine);
+}
+
+packToken calculator::eval(const TokenMap &vars, bool keep_refs, Arena* arena) const {
+  return eval_args(0, vars, keep_refs, arena);
+}
+
+packToken calculator::eval(const std::vector<packToken>& args, const TokenMap &vars,
+                           bool keep_refs, Arena* arena) const {
+  if (args.size() < this->compiled->schema.size()) {
+    // throw std::invalid_argument("Missing values for the schema slots!");
+    return false;
+  }
+  return eval_args(args.data(), vars, keep_refs, arena);
 }
 
-packToken calculator::eval(const TokenMap &vars, bool keep_refs) const {
-  TokenBase* value = calculate(this->RPN, vars, Config());
+packToken calculator::eval_args(const packToken* args, const TokenMap &vars,
+                                bool keep_refs, Arena* arena) const {
+  TokenBase* value;
+  if (this->engine == CLOSURES) {
+    value = this->compiled->closures.exec(vars, Config(), arena, args);
+  } else {
+    value = this->compiled->program.exec(vars, Config(), arena, args);
+  }
   if (value)
   {
-    packToken p = packToken(value->clone());
     if (keep_refs) {
       return packToken(value);
     } else {
@@ -725,44 +2310,729 @@ packToken calculator::eval(const TokenMap &vars, bool keep_refs) const {
 
 std::unordered_set<std::string> calculator::get_variables() const {
   std::unordered_set<std::string> vars;
-  for (const auto& i: RPN) {
-    if (i->type == tokType::VAR_Token) {
-      vars.insert(static_cast<Token<std::string>*>(i)->val);
-    }
+  for (const Symbol& name : compiled->program.names) {
+    vars.insert(name);
   }
   return vars;
 }
 
 calculator& calculator::operator=(const calculator& calc) {
-  // Make sure the RPN is empty:
-  rpnBuilder::cleanRPN(&this->RPN);
+  this->compiled = calc.compiled;
+  this->engine = calc.engine;
+  return *this;
+}
 
-  // Deep copy the token list, so everything can be
-  // safely deallocated:
-  TokenQueue_t _rpn = calc.RPN;
-  while (!_rpn.empty()) {
-    TokenBase* base = _rpn.front();
-    _rpn.pop();
-    this->RPN.push(base->clone());
-  }
+calculator& calculator::operator=(calculator&& calc) {
+  if (this == &calc) return *this;
+
+  this->compiled = std::move(calc.compiled);
+  this->engine = calc.engine;
+  calc.compiled = none();
+  calc.engine = INTERPRETER;
   return *this;
 }
 
+/* * * * * Batch evaluation * * * * */
+
+packToken Column::at(size_t row) const {
+  switch (type) {
+  case REAL_Token:
+    return static_cast<const double*>(data)[row];
+  case INT_Token:
+    return static_cast<const int64_t*>(data)[row];
+  case BOOL_Token:
+    return static_cast<const bool*>(data)[row];
+  case STR_Token:
+    return static_cast<const std::string*>(data)[row];
+  default:
+    return packToken::None();
+  }
+}
+
+namespace cparse {
+namespace {
+
+// Number of rows evaluated together by the batch kernels:
+const size_t BATCH_BLOCK = 1024;
+
+inline bool isBatchType(tokType_t type) {
+  return type == REAL_Token || type == INT_Token || type == BOOL_Token;
+}
+
+// A numeric sub-expression of a Program that is evaluated
+// for a whole block of rows by the batch kernels:
+struct batchRange_t {
+  struct step_t {
+    // Either apply a kernel to the 2 values on top of the stack
+    // or push the values of a column or a constant:
+    batchFunc_t kernel;
+    const Column* column;
+    double constant;
+  };
+
+  // The instructions it replaces, from `begin` to `end` inclusive:
+  uint32_t begin, end;
+  tokType_t type;
+  std::vector<step_t> steps;
+  uint32_t depth;
+
+  // The constant of the row program that receives its values:
+  uint32_t constant;
+
+  // Evaluate rows [first, first+size) into stack[0]:
+  void exec(size_t first, size_t size, std::vector<std::vector<double>>* stack) const {
+    size_t top = 0;
+    for (const step_t& step : steps) {
+      if (step.kernel) {
+        --top;
+        double* left = (*stack)[top-1].data();
+        step.kernel(left, (*stack)[top].data(), left, size);
+        continue;
+      }
+
+      double* values = (*stack)[top++].data();
+      if (!step.column) {
+        std::fill(values, values + size, step.constant);
+      } else if (step.column->type == REAL_Token) {
+        const double* column = static_cast<const double*>(step.column->data) + first;
+        std::copy(column, column + size, values);
+      } else if (step.column->type == INT_Token) {
+        const int64_t* column = static_cast<const int64_t*>(step.column->data) + first;
+        for (size_t i = 0; i < size; ++i) values[i] = static_cast<double>(column[i]);
+      } else {
+        const bool* column = static_cast<const bool*>(step.column->data) + first;
+        for (size_t i = 0; i < size; ++i) values[i] = column[i];
+      }
+    }
+  }
+
+  packToken value(double v) const {
+    return type == BOOL_Token ? packToken(v != 0) : packToken(v);
+  }
+};
+
+// The name of the variable read by a PUSH_VAR or PUSH_ARG instruction:
+const Symbol& variableName(const Program& program, const Instruction& inst) {
+  return inst.code == PUSH_VAR ? program.names[inst.arg] : program.args[inst.arg];
+}
+
+// Find the numeric sub-expressions of `program` that can be evaluated
+// by batch kernels and build the program that evaluates the rest
+// of the expression for each row.
+//
+// Only sub-expressions evaluated before any other operator are
+// selected, so no side effect could change their operands.
+std::vector<batchRange_t> planBatch(const Program& program, const ColumnMap_t& columns,
+                                    const opMap_t& opMap, Program* rows) {
+  struct entry_t {
+    bool batch, has_op;
+    tokType_t type;
+    uint32_t begin, end;
+  };
+
+  std::vector<batchRange_t> ranges;
+  std::vector<batchFunc_t> kernels(program.code.size());
+  std::vector<entry_t> stack;
+  bool clean = true;
+
+  auto select = [&ranges](const entry_t& e) {
+    if (e.batch && e.has_op) {
+      batchRange_t range;
+      range.begin = e.begin;
+      range.end = e.end;
+      range.type = e.type;
+      ranges.push_back(range);
+    }
+  };
+
+  for (uint32_t i = 0; i < program.code.size(); ++i) {
+    const Instruction& inst = program.code[i];
+    entry_t e = {false, false, NONE_Token, i, i};
+
+    if (inst.code == PUSH_CONST) {
+      e.type = program.constants[inst.arg]->type;
+      e.batch = isBatchType(e.type) || e.type == UNARY_Token;
+    } else if (inst.code == PUSH_VAR || inst.code == PUSH_ARG) {
+      auto it = columns.find(variableName(program, inst));
+      if (it != columns.end()) {
+        e.type = it->second.type;
+        e.batch = isBatchType(e.type);
+      }
+    } else if (inst.code == SAVE_SLOT) {
+      // The row program saves the value computed for the range:
+      if (stack.empty()) return std::vector<batchRange_t>();
+      select(stack.back());
+      stack.back().batch = false;
+      stack.back().end = i;
+      continue;
+    } else if (inst.code == LOAD_SLOT) {
+      e.type = NONE_Token;
+    } else {
+      if (stack.size() < 2) return std::vector<batchRange_t>();
+      entry_t r = stack.back(); stack.pop_back();
+      entry_t l = stack.back(); stack.pop_back();
+      e.begin = l.begin;
+
+      const batchKernel_t* kernel = nullptr;
+      if (inst.code == APPLY_OP && clean && l.batch && r.batch) {
+        kernel = opMap.dispatch().findBatch(inst.arg, l.type, r.type);
+      }
+
+      if (kernel) {
+        kernels[i] = kernel->func;
+        e.batch = e.has_op = true;
+        e.type = kernel->type;
+      } else {
+        select(l);
+        select(r);
+        clean = false;
+      }
+    }
+    stack.push_back(e);
+  }
+  if (stack.size() == 1) select(stack.back());
+
+  // Build the steps of each range:
+  std::sort(ranges.begin(), ranges.end(),
+            [](const batchRange_t& a, const batchRange_t& b) { return a.begin < b.begin; });
+  for (batchRange_t& range : ranges) {
+    uint32_t depth = 0;
+    range.depth = 0;
+    for (uint32_t i = range.begin; i <= range.end; ++i) {
+      const Instruction& inst = program.code[i];
+      batchRange_t::step_t step = {kernels[i], nullptr, 0};
+
+      if (inst.code == PUSH_VAR || inst.code == PUSH_ARG) {
+        step.column = &columns.find(variableName(program, inst))->second;
+      } else if (inst.code == PUSH_CONST) {
+        const packToken& constant = program.constants[inst.arg];
+        step.constant = constant->type == UNARY_Token ? 0 : constant.asDouble();
+      }
+
+      if (step.kernel) {
+        --depth;
+      } else if (++depth > range.depth) {
+        range.depth = depth;
+      }
+      range.steps.push_back(step);
+    }
+  }
+
+  // Replace each range by a constant on the row program:
+  *rows = program;
+  rows->code.clear();
+  uint32_t i = 0;
+  for (batchRange_t& range : ranges) {
+    for (; i < range.begin; ++i) rows->code.push_back(program.code[i]);
+    range.constant = rows->constants.size();
+    rows->code.push_back(Instruction(PUSH_CONST, range.constant));
+    rows->constants.push_back(packToken::None());
+    i = range.end + 1;
+  }
+  for (; i < program.code.size(); ++i) rows->code.push_back(program.code[i]);
+
+  return ranges;
+}
+
+}  // namespace
+}  // namespace cparse
+
+std::vector<packToken> calculator::eval_batch(const ColumnMap_t& columns, size_t rows,
+                                              const TokenMap& vars) const {
+  std::vector<packToken> results;
+
+  for (const auto& pair : columns) {
+    if (pair.second.size < rows) {
+      // throw std::invalid_argument("Column `" + pair.first + "` is too short!");
+      return results;
+    }
+  }
+
+  const Config_t& config = Config();
+  Program row_program;
+  std::vector<batchRange_t> ranges = planBatch(this->compiled->program, columns,
+                                               config.opMap, &row_program);
+
+  // If the whole expression is numeric there is nothing left to do per row:
+  bool vectorized = ranges.size() == 1 && row_program.code.size() == 1;
+
+  // Bind only the columns used by the expression:
+  std::vector<std::pair<std::string, const Column*>> bound;
+  for (const Instruction& inst : this->compiled->program.code) {
+    if (inst.code != PUSH_VAR && inst.code != PUSH_ARG) continue;
+    const std::string& name = variableName(this->compiled->program, inst);
+    auto it = columns.find(name);
+    if (it == columns.end()) continue;
+    auto same = [&name](const std::pair<std::string, const Column*>& b) {
+      return b.first == name;
+    };
+    if (std::find_if(bound.begin(), bound.end(), same) == bound.end()) {
+      bound.push_back(std::make_pair(name, &it->second));
+    }
+  }
+
+  uint32_t depth = 1;
+  for (const batchRange_t& range : ranges) {
+    if (range.depth > depth) depth = range.depth;
+  }
+  std::vector<std::vector<double>> stack(depth, std::vector<double>(BATCH_BLOCK));
+  std::vector<std::vector<double>> values(ranges.size(), std::vector<double>(BATCH_BLOCK));
+
+  TokenMap row(const_cast<TokenMap*>(&vars));
+  Arena arena;
+  results.reserve(rows);
+  for (size_t first = 0; first < rows; first += BATCH_BLOCK) {
+    size_t size = std::min(BATCH_BLOCK, rows - first);
+
+    for (size_t i = 0; i < ranges.size(); ++i) {
+      ranges[i].exec(first, size, &stack);
+      values[i].swap(stack[0]);
+    }
+
+    if (vectorized) {
+      for (size_t r = 0; r < size; ++r) {
+        results.push_back(ranges[0].value(values[0][r]));
+      }
+      continue;
+    }
+
+    for (size_t r = 0; r < size; ++r) {
+      // Discard the variables created by the previous row:
+      if (row.map().size() != bound.size()) row.map().clear();
+      for (const auto& b : bound) {
+        row.map()[b.first] = b.second->at(first + r);
+      }
+      for (size_t i = 0; i < ranges.size(); ++i) {
+        row_program.constants[ranges[i].constant] = ranges[i].value(values[i][r]);
+      }
+
+      TokenBase* value = row_program.exec(row, config, &arena);
+      if (value) {
+        results.push_back(packToken(resolve_reference(value)));
+      } else {
+        results.push_back(false);
+      }
+      arena.reset();
+    }
+  }
+
+  return results;
+}
+
+/* * * * * Binary serialization * * * * */
+
+// The format saved by calculator::save() is a fixed header followed
+// by the tables of a Program, all integers in little-endian order:
+//
+//   "CPRS", u32 version, u64 config fingerprint, u8 engine,
+//   u8 reserved, u16 reserved,
+//   ops:       u32 count, then the names of the operators applied,
+//   names:     u32 count, then the names of the variables,
+//   schema:    u32 count, then the name and u8 type of each field,
+//   code:      u32 count, then 8 bytes per instruction:
+//              u8 opcode, u8 ref, u16 reserved, u32 arg,
+//   constants: u32 count, then the tokens, tagged by their tokType.
+//
+// Strings are saved as an u32 size followed by their bytes.
+// The APPLY_OP and CALL_OP instructions refer to the ops table,
+// so the ids of the operators don't need to match across processes.
+
+namespace cparse {
+namespace {
+
+const char FORMAT_MAGIC[4] = {'C', 'P', 'R', 'S'};
+
+// Bounds the recursion on nested constants, e.g. maps of maps:
+const uint32_t MAX_NESTING = 64;
+
+struct binaryWriter {
+  std::string out;
+
+  void u8(uint8_t value) { out.push_back(static_cast<char>(value)); }
+  void u16(uint16_t value) { u8(value); u8(value >> 8); }
+  void u32(uint32_t value) { u16(value); u16(value >> 16); }
+  void u64(uint64_t value) { u32(value); u32(value >> 32); }
+  void str(const std::string& value) {
+    u32(value.size());
+    out.append(value);
+  }
+
+  // Functions are saved by name, `name` is the one of the
+  // variable they were read from, if any.
+  // Returns false if `base` can't be saved:
+  bool token(const TokenBase* base, const std::string& name = "", uint32_t nest = 0) {
+    if (nest > MAX_NESTING) return false;
+
+    if (base->type & REF_Token) {
+      const RefToken* ref = static_cast<const RefToken*>(base);
+      u8(REF_Token);
+      return token(ref->key.token(), "", nest + 1) &&
+             token(ref->origin.token(), "", nest + 1) &&
+             token(ref->value().token(), ref->key.asString(), nest + 1);
+    }
+
+    u8(base->type);
+    switch (base->type) {
+    case NONE_Token: case UNARY_Token:
+      return true;
+    case INT_Token:
+      u64(static_cast<const Token<int64_t>*>(base)->val);
+      return true;
+    case REAL_Token: {
+      uint64_t bits;
+      std::memcpy(&bits, &static_cast<const Token<double>*>(base)->val, sizeof(bits));
+      u64(bits);
+      return true;
+    }
+    case BOOL_Token:
+      u8(static_cast<const Token<uint8_t>*>(base)->val);
+      return true;
+    case STR_Token: case VAR_Token:
+      str(static_cast<const Token<std::string>*>(base)->val.str());
+      return true;
+    case FUNC_Token: {
+      const std::string func_name = static_cast<const Function*>(base)->name();
+      if (func_name.empty() && name.empty()) return false;
+      str(func_name.empty() ? name : func_name);
+      return true;
+    }
+    case LIST_Token: case TUPLE_Token: case STUPLE_Token: {
+      const TokenList_t& list = static_cast<const TokenList*>(base)->list();
+      u32(list.size());
+      for (const packToken& item : list) {
+        if (!token(item.token(), "", nest + 1)) return false;
+      }
+      return true;
+    }
+    case MAP_Token: {
+      // Only the maps that inherit from the default
+      // prototype, or from none, are saved:
+      const TokenMap* map = static_cast<const TokenMap*>(base);
+      if (map->parent() && map->parent() != &TokenMap::base_map()) return false;
+      u8(map->parent() ? 0 : 1);
+      u32(map->map().size());
+      for (const TokenMap_t::value_type& entry : map->map()) {
+        str(entry.first.str());
+        if (!token(entry.second.token(), "", nest + 1)) return false;
+      }
+      return true;
+    }
+    default:
+      return false;
+    }
+  }
+};
+
+// Reads the data saved by binaryWriter. Once a read is
+// out of bounds or invalid `ok` is false and every
+// read after it returns a default value:
+struct binaryReader {
+  const char* data;
+  size_t size;
+  size_t pos = 0;
+  bool ok = true;
+
+  binaryReader(const char* data, size_t size) : data(data), size(size) {}
+
+  bool has(size_t bytes) {
+    if (size - pos < bytes) ok = false;
+    return ok;
+  }
+
+  uint8_t u8() { return has(1) ? static_cast<uint8_t>(data[pos++]) : 0; }
+  uint16_t u16() { uint16_t low = u8(); return low | (u8() << 8); }
+  uint32_t u32() { uint32_t low = u16(); return low | (static_cast<uint32_t>(u16()) << 16); }
+  uint64_t u64() { uint64_t low = u32(); return low | (static_cast<uint64_t>(u32()) << 32); }
+  std::string str() {
+    uint32_t length = u32();
+    if (!has(length)) return "";
+    pos += length;
+    return std::string(data + pos - length, length);
+  }
+
+  // Counts are checked against the bytes left, so corrupted
+  // data can't make the loader reserve huge tables:
+  uint32_t count(size_t min_bytes) {
+    uint32_t value = u32();
+    if (ok && value > (size - pos) / min_bytes) ok = false;
+    return ok ? value : 0;
+  }
+
+  packToken fail() {
+    ok = false;
+    return packToken::None();
+  }
+
+  // The functions are looked up by name on `vars`:
+  packToken token(const TokenMap& vars, uint32_t nest = 0) {
+    if (nest > MAX_NESTING) return fail();
+
+    uint8_t type = u8();
+    if (!ok) return packToken::None();
+
+    switch (type) {
+    case NONE_Token:
+      return packToken::None();
+    case UNARY_Token:
+      return packToken(TokenUnary());
+    case INT_Token:
+      return packToken(static_cast<int64_t>(u64()));
+    case REAL_Token: {
+      uint64_t bits = u64();
+      double value;
+      std::memcpy(&value, &bits, sizeof(value));
+      return packToken(value);
+    }
+    case BOOL_Token:
+      return packToken(u8() != 0);
+    case STR_Token:
+      return packToken(str());
+    case VAR_Token:
+      return packToken(str(), VAR_Token);
+    case FUNC_Token: {
+      const packToken* func = vars.find(str());
+      if (!ok || !func || (*func)->type != FUNC_Token) return fail();
+      return *func;
+    }
+    case LIST_Token: case TUPLE_Token: case STUPLE_Token: {
+      TokenList* list = type == LIST_Token ? new TokenList() :
+                        type == TUPLE_Token ? new Tuple() : new STuple();
+      packToken result(static_cast<TokenBase*>(list));
+      uint32_t items = count(1);
+      list->list().reserve(items);
+      for (uint32_t i = 0; i < items && ok; ++i) {
+        list->list().push_back(token(vars, nest + 1));
+      }
+      return result;
+    }
+    case MAP_Token: {
+      TokenMap map(u8() ? 0 : &TokenMap::base_map());
+      uint32_t entries = count(5);
+      for (uint32_t i = 0; i < entries && ok; ++i) {
+        std::string key = str();
+        map[key] = token(vars, nest + 1);
+      }
+      return map;
+    }
+    case REF_Token: {
+      packToken key = token(vars, nest + 1);
+      packToken origin = token(vars, nest + 1);
+      packToken value = token(vars, nest + 1);
+      if (!ok || (value->type & REF_Token)) return fail();
+      return packToken(static_cast<TokenBase*>(new RefToken(key, value, origin)));
+    }
+    default:
+      return fail();
+    }
+  }
+};
+
+}  // namespace
+}  // namespace cparse
+
+uint64_t calculator::fingerprint(const Config_t& config) {
+  binaryWriter writer;
+  for (const auto& entry : config.opMap) {
+    writer.str(entry.first);
+    for (const Operation& operation : entry.second) {
+      writer.u64(operation.getMask());
+      writer.u8(operation.getFlags());
+    }
+  }
+
+  uint64_t hash = 14695981039346656037ULL;
+  for (char c : writer.out) {
+    hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+std::string calculator::save() const {
+  const Program& program = this->compiled->program;
+  const Schema& schema = this->compiled->schema;
+  binaryWriter writer;
+
+  writer.out.append(FORMAT_MAGIC, sizeof(FORMAT_MAGIC));
+  writer.u32(FORMAT_VERSION);
+  writer.u64(fingerprint(Config()));
+  writer.u8(this->engine);
+  writer.u8(0);
+  writer.u16(0);
+
+  // Number the operators in the order they are first applied:
+  std::vector<opSymbol_t> ops;
+  std::vector<uint32_t> op_index(program.code.size(), 0);
+  for (size_t i = 0; i < program.code.size(); ++i) {
+    const Instruction& inst = program.code[i];
+    if (inst.code != APPLY_OP && inst.code != CALL_OP) continue;
+    op_index[i] = std::find(ops.begin(), ops.end(), inst.arg) - ops.begin();
+    if (op_index[i] == ops.size()) ops.push_back(inst.arg);
+  }
+
+  writer.u32(ops.size());
+  for (opSymbol_t op : ops) writer.str(opSymbols::name(op));
+
+  writer.u32(program.names.size());
+  for (const Symbol& name : program.names) writer.str(name.str());
+
+  writer.u32(schema.size());
+  for (const Schema::field_t& field : schema.fields) {
+    writer.str(field.name);
+    writer.u8(field.type);
+  }
+
+  // The Program is saved unbound, load() binds it to the schema again:
+  writer.u32(program.code.size());
+  for (size_t i = 0; i < program.code.size(); ++i) {
+    const Instruction& inst = program.code[i];
+    uint8_t code = inst.code;
+    uint32_t arg = inst.arg;
+    if (inst.code == APPLY_OP || inst.code == CALL_OP) {
+      arg = op_index[i];
+    } else if (inst.code == PUSH_ARG) {
+      const Symbol& name = program.args[inst.arg];
+      code = PUSH_VAR;
+      arg = std::find(program.names.begin(), program.names.end(), name) - program.names.begin();
+    }
+    writer.u8(code);
+    writer.u8(inst.ref);
+    writer.u16(0);
+    writer.u32(arg);
+  }
+
+  writer.u32(program.constants.size());
+  for (const packToken& constant : program.constants) {
+    if (!writer.token(constant.token())) {
+      // throw std::invalid_argument("This expression can't be saved!");
+      return "";
+    }
+  }
+
+  return writer.out;
+}
+
+bool calculator::load(const char* data, size_t size, const TokenMap& vars) {
+  binaryReader reader(data, size);
+  const Config_t& config = Config();
+
+  if (size < sizeof(FORMAT_MAGIC) || std::memcmp(data, FORMAT_MAGIC, sizeof(FORMAT_MAGIC))) {
+    return false;
+  }
+  reader.pos = sizeof(FORMAT_MAGIC);
+
+  if (reader.u32() != FORMAT_VERSION) {
+    // throw std::invalid_argument("Unknown format version!");
+    return false;
+  }
+  bool same_config = reader.u64() == fingerprint(config);
+  uint8_t engine = reader.u8();
+  reader.u8();
+  reader.u16();
+  if (engine != INTERPRETER && engine != CLOSURES) return false;
+
+  Program program;
+
+  // Operators built for another config must exist on this one:
+  std::vector<opSymbol_t> ops(reader.count(4));
+  for (opSymbol_t& op : ops) {
+    std::string name = reader.str();
+    // ANY_OP operations only apply to the operators the parser knows,
+    // i.e. the ones on opPrecedence, so they don't count here:
+    if (!same_config && !config.opMap.count(name) && !config.opPrecedence.exists(name)) {
+      // throw std::invalid_argument("Undefined operator `" + name + "`!");
+      return false;
+    }
+    op = opSymbols::intern(name);
+  }
+
+  program.names.resize(reader.count(4));
+  for (Symbol& name : program.names) name = Symbol(reader.str());
+
+  Schema schema;
+  uint32_t fields = reader.count(5);
+  for (uint32_t i = 0; i < fields && reader.ok; ++i) {
+    std::string name = reader.str();
+    schema.add(name, static_cast<tokType_t>(reader.u8()));
+  }
+
+  uint32_t instructions = reader.count(8);
+  program.code.reserve(instructions);
+  for (uint32_t i = 0; i < instructions && reader.ok; ++i) {
+    opCode_t code = static_cast<opCode_t>(reader.u8());
+    bool ref = reader.u8() != 0;
+    reader.u16();
+    program.code.push_back(Instruction(code, reader.u32()));
+    program.code.back().ref = ref;
+  }
+
+  uint32_t constants = reader.count(1);
+  program.constants.reserve(constants);
+  for (uint32_t i = 0; i < constants && reader.ok; ++i) {
+    program.constants.push_back(reader.token(vars));
+  }
+
+  if (!reader.ok || reader.pos != size) return false;
+
+  // Check the operands of the instructions, and compute the
+  // stack depth and infer the numeric evaluation as compile() does:
+  static const opSymbol_t call_op = opSymbols::intern("()");
+  uint32_t depth = 0;
+  bool numeric = true;
+  for (Instruction& inst : program.code) {
+    switch (inst.code) {
+    case PUSH_CONST: {
+      if (inst.arg >= program.constants.size()) return false;
+      const TokenBase* base = program.constants[inst.arg].token();
+      numeric = numeric && (base->type == UNARY_Token || numeralType(base) != NONE_Token);
+      break;
+    }
+    case PUSH_VAR:
+      if (inst.arg >= program.names.size()) return false;
+      break;
+    case APPLY_OP: case CALL_OP:
+      if (inst.arg >= ops.size()) return false;
+      inst.arg = ops[inst.arg];
+      inst.code = inst.arg == call_op ? CALL_OP : APPLY_OP;
+      numeric = numeric && inst.code == APPLY_OP && depth >= 2;
+      if (depth) --depth;
+      continue;
+    case SAVE_SLOT:
+      // Each slot is saved by at least one instruction:
+      if (!depth || inst.arg >= program.code.size()) return false;
+      program.slots = std::max(program.slots, inst.arg + 1);
+      continue;
+    case LOAD_SLOT:
+      if (inst.arg >= program.code.size()) return false;
+      program.slots = std::max(program.slots, inst.arg + 1);
+      break;
+    default:
+      return false;
+    }
+    program.depth = std::max(program.depth, ++depth);
+  }
+
+  program.inferred_numeric = numeric && depth == 1 && program.code.size() > 1 &&
+                             program.depth <= Program::MAX_NUMERIC_DEPTH &&
+                             program.slots <= Program::MAX_NUMERIC_DEPTH;
+
+  this->engine = static_cast<engine_t>(engine);
+  this->compiled = assemble(std::move(program), schema, this->engine, config);
+  return true;
+}
+
 /* * * * * For Debug Only * * * * */
 
 std::string calculator::str() const {
-  return str(this->RPN);
+  return "calculator { RPN: [ " + this->compiled->program.str() + " ] }";
 }
 
-std::string calculator::str(TokenQueue_t rpn) {
+std::string calculator::str(const TokenQueue_t& rpn) {
   std::stringstream ss;
 
   ss << "calculator { RPN: [ ";
-  while (rpn.size()) {
-    ss << packToken(resolve_reference(rpn.front()->clone())).str();
-    rpn.pop();
-
-    ss << (rpn.size() ? ", ":"");
+  for (TokenQueue_t::const_iterator it = rpn.begin(); it != rpn.end(); ++it) {
+    ss << (it != rpn.begin() ? ", " : "");
+    ss << packToken(resolve_reference((*it)->clone())).str();
   }
   ss << " ] }";
   return ss.str();
@@ -776,90 +3046,74 @@ using cparse::Function;
 using cparse::TokenList;
 using cparse::TokenMap;
 using cparse::CppFunction;
+using cparse::Frame;
+
+/* * * * * class Frame * * * * */
+TokenMap& Frame::scope() {
+  if (local) return *local;
 
-/* * * * * class Function * * * * */
-packToken Function::call(packToken _this, const Function* func,
-                         TokenList* args, TokenMap& scope) {
   // Build the local namespace:
-  TokenMap kwargs;
-  TokenMap local = scope.getChild();
+  local.reset(new (arena) TokenMap(parent.getChild()));
+  size_t i = 0;
+  for (const std::string& name : func->args()) {
+    if (i == argc) break;
+    (*local)[name] = argv[i++];
+  }
 
-  args_t arg_names = func->args();
+  /* * * * * Set built-in variables: * * * * */
+
+  static const Symbol this_key("this");
+  (*local)[this_key] = self();
+  // (*local)["args"] = arglist;
+  // (*local)["kwargs"] = kwargs;
 
-  TokenList_t::iterator args_it = args->list().begin();
-  args_t::const_iterator names_it = arg_names.begin();
+  return *local;
+}
 
+/* * * * * class Function * * * * */
+packToken Function::call(packToken _this, const Function* func,
+                         TokenList* args, TokenMap& scope) {
+  const TokenList_t& list = args->list();
+  return call(&_this, func, list.data(), list.size(), scope);
+}
+
+packToken Function::call(const packToken* _this, const Function* func,
+                         const packToken* argv, size_t argc, TokenMap& scope,
+                         Arena* arena) {
   /* * * * * Parse positional arguments: * * * * */
 
-  while (args_it != args->list().end() && names_it != arg_names.end()) {
+  size_t positional = 0;
+  size_t nargs = func->args().size();
+  while (positional < argc && positional < nargs) {
     // If the positional argument list is over:
-    if ((*args_it)->type == STUPLE_Token) break;
-
-    // Else add it to the local namespace:
-    local[*names_it] = *args_it;
-
-    ++args_it;
-    ++names_it;
-  }
-
-  // /* * * * * Parse extra positional arguments: * * * * */
-  //
-  // TokenList arglist;
-  // for (; args_it != args->list().end(); ++args_it) {
-  //   // If there is a keyword argument:
-  //   if ((*args_it)->type == STUPLE_Token) break;
-  //   // Else add it to arglist:
-  //   arglist.list().push_back(*args_it);
-  // }
-
-  // /* * * * * Parse keyword arguments: * * * * */
-  //
-  // for (; args_it != args->list().end(); ++args_it) {
-  //   packToken& arg = *args_it;
-  //
-  //   if (arg->type != STUPLE_Token) {
-  //     throw syntax_error("Positional argument follows keyword argument");
-  //   }
-  //
-  //   STuple* st = static_cast<STuple*>(arg.token());
-  //
-  //   if (st->list().size() != 2) {
-  //     throw syntax_error("Keyword tuples must have exactly 2 items!");
-  //   }
-  //
-  //   if (st->list()[0]->type != STR_Token) {
-  //     throw syntax_error("Keyword first argument should be of type string!");
-  //   }
-  //
-  //   // Save it:
-  //   std::string key = st->list()[0].asString();
-  //   packToken& value = st->list()[1];
-  //   kwargs[key] = value;
-  // }
-
-  // /* * * * * Set missing positional arguments: * * * * */
-  //
-  // for (; names_it != arg_names.end(); ++names_it) {
-  //   // If not set by a keyword argument:
-  //   auto kw_it = kwargs.map().find(*names_it);
-  //   if (kw_it == kwargs.map().end()) {
-  //     local[*names_it] = packToken::None();
-  //   } else {
-  //     local[*names_it] = kw_it->second;
-  //     kwargs.map().erase(kw_it);
-  //   }
-  // }
-
-  /* * * * * Set built-in variables: * * * * */
+    if (argv[positional]->type == STUPLE_Token) break;
+    ++positional;
+  }
 
-  local["this"] = _this;
-  // local["args"] = arglist;
-  // local["kwargs"] = kwargs;
+  // Extra positional arguments and keyword
+  // arguments are not supported yet.
 
-  return func->exec(local);
+  Frame frame(func, _this, argv, positional, scope, arena);
+  return func->exec(frame);
 }
 
 /* * * * * class CppFunction * * * * */
+packToken CppFunction::exec(TokenMap& scope) const {
+  if (frameFunc) {
+    // Read the arguments back from the scope:
+    std::vector<packToken> argv;
+    for (const std::string& name : _args) {
+      const packToken* value = scope.find(name);
+      argv.push_back(value ? *value : packToken::None());
+    }
+    static const Symbol this_key("this");
+    const packToken* _this = scope.find(this_key);
+    Frame frame(this, _this, argv.data(), argv.size(), scope);
+    return frameFunc(frame);
+  }
+  return isStdFunc ? stdFunc(scope) : func(scope);
+}
+
 CppFunction::CppFunction() {
     this->_name = "";
     this->isStdFunc = false;
@@ -923,4 +3177,11 @@ CppFunction::CppFunction(std::function<packToken(TokenMap)> func, std::string na
     this->_name = name;
     this->isStdFunc = true;
 }
+
+CppFunction::CppFunction(packToken (*func)(Frame&), const args_t args,
+                         std::string name)
+                         : func(NULL), frameFunc(func), _args(args) {
+  this->_name = name;
+  this->isStdFunc = false;
+}
 #pragma endregion
\ No newline at end of file
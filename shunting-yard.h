@@ -11,9 +11,15 @@
 #include <set>
 #include <sstream>
 #include <memory>
+#include <new>
+#include <type_traits>
 #include <utility>
 #include <deque>
 #include <unordered_set>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <cstring>
 
 namespace cparse {
 
@@ -34,6 +40,9 @@ enum tokType {
   // Note: The mask system accepts at most 29 (32-3) different base types.
   STR_Token, FUNC_Token,
 
+  // Internal type used to reuse values on compiled expressions:
+  SLOT_Token = 0x1F,
+
   // Numerals:
   NUM_Token = 0x20,   // Everything with the bit 0x20 set is a number.
   REAL_Token = 0x21,  // == 0x20 + 0x1 => Real numbers.
@@ -57,6 +66,8 @@ enum tokType {
 
 #define ANY_OP ""
 
+class Arena;
+
 struct TokenBase {
   tokType_t type;
 
@@ -65,6 +76,25 @@ struct TokenBase {
   TokenBase(tokType_t type) : type(type) {}
 
   virtual TokenBase* clone() const = 0;
+
+  // Tokens might also be allocated from an Arena, e.g. `new (arena) TokenNone()`,
+  // and deleting them is then a no-op until the arena is reset.
+  //
+  // Each allocation starts with a small header that records where it
+  // came from, so `delete` knows it without searching the arenas:
+  static void* operator new(size_t size) { return allocate(size, nullptr); }
+  static void* operator new(size_t size, Arena* arena) { return allocate(size, arena); }
+  static void operator delete(void* ptr) { release(ptr); }
+  static void operator delete(void* ptr, Arena*) { release(ptr); }
+
+  // Allocate from `arena`, or from the heap if it is nullptr:
+  static void* allocate(size_t size, Arena* arena);
+  // Free `ptr` unless it was allocated from an arena:
+  static void release(void* ptr);
+
+  // Placement new, hidden by the overloads above:
+  static void* operator new(size_t, void* ptr) { return ptr; }
+  static void operator delete(void*, void*) {}
 };
 
 template<class T> class Token : public TokenBase {
@@ -75,6 +105,123 @@ template<class T> class Token : public TokenBase {
     return new Token(*this);
   }
 };
+
+// Identifiers and map keys are interned into a global table the first
+// time they are stored, so two Symbols are equal only if they are the
+// same pointer and their hashes are computed only once.
+// The entries are reference counted and a name is removed from the table
+// with its last Symbol, e.g. when the maps and the compiled expressions
+// that use it are destroyed. Names that are only looked up are never
+// interned. Symbols may be interned and released from several threads.
+class Symbol {
+ public:
+  struct entry_t {
+    std::shared_ptr<std::string> name;
+    size_t hash;
+    mutable std::atomic<size_t> refs;
+    entry_t(const std::shared_ptr<std::string>& name, size_t hash)
+      : name(name), hash(hash), refs(0) {}
+  };
+
+ private:
+  const entry_t* entry = 0;
+
+  // Must be called with the table locked:
+  explicit Symbol(const entry_t* entry) : entry(entry) { acquire(); }
+
+  void acquire() { if (entry) entry->refs.fetch_add(1, std::memory_order_relaxed); }
+  static void release(const entry_t* entry);
+
+ public:
+  // The null Symbol, that is different from every interned one:
+  Symbol() {}
+  explicit Symbol(const std::string& name) : Symbol(name.data(), name.size()) {}
+  explicit Symbol(const char* name) : Symbol(name, strlen(name)) {}
+  Symbol(const char* name, size_t size);
+
+  Symbol(const Symbol& other) : entry(other.entry) { acquire(); }
+  Symbol(Symbol&& other) : entry(other.entry) { other.entry = 0; }
+  ~Symbol() { if (entry) release(entry); }
+  Symbol& operator=(Symbol other) {
+    std::swap(entry, other.entry);
+    return *this;
+  }
+
+  // The hash of the Symbols and of the TokenMap keys:
+  static size_t hash(const char* data, size_t size);
+
+  // Return the Symbol of `name` if it was already interned
+  // or the null Symbol otherwise, without interning it:
+  static Symbol find(const char* name, size_t size);
+  static Symbol find(const std::string& name) { return find(name.data(), name.size()); }
+
+  // The number of interned Symbols:
+  static size_t count();
+
+  bool null() const { return entry == 0; }
+  const std::string& str() const { return *entry->name; }
+  operator const std::string&() const { return *entry->name; }
+  size_t hash() const { return entry->hash; }
+
+  // The interned string, shared with the tokens built from this Symbol:
+  const std::shared_ptr<std::string>& shared() const { return entry->name; }
+
+  bool operator==(const Symbol& other) const { return entry == other.entry; }
+  bool operator!=(const Symbol& other) const { return entry != other.entry; }
+  bool operator==(const std::string& s) const { return entry && *entry->name == s; }
+  bool operator!=(const std::string& s) const { return !(*this == s); }
+};
+
+inline bool operator==(const std::string& s, const Symbol& symbol) { return symbol == s; }
+inline bool operator!=(const std::string& s, const Symbol& symbol) { return symbol != s; }
+
+inline std::ostream& operator<<(std::ostream& os, const Symbol& s) {
+  return os << s.str();
+}
+
+// An immutable string shared by all its copies, so copying
+// it is O(1) no matter how long the string is.
+// mut() copies it before it is modified if it is shared.
+class sharedString_t {
+  std::shared_ptr<std::string> payload;
+
+ public:
+  sharedString_t(const std::string& s) : payload(std::make_shared<std::string>(s)) {}
+  sharedString_t(std::string&& s) : payload(std::make_shared<std::string>(std::move(s))) {}
+  sharedString_t(const char* s) : payload(std::make_shared<std::string>(s)) {}
+  sharedString_t(const Symbol& s) : payload(s.shared()) {}
+
+  const std::string& str() const { return *payload; }
+  operator const std::string&() const { return *payload; }
+
+  std::string& mut() {
+    if (payload.use_count() > 1) {
+      payload = std::make_shared<std::string>(*payload);
+    }
+    return *payload;
+  }
+
+  bool operator==(const std::string& s) const { return *payload == s; }
+  bool operator!=(const std::string& s) const { return *payload != s; }
+};
+
+inline std::ostream& operator<<(std::ostream& os, const sharedString_t& s) {
+  return os << s.str();
+}
+
+// STR and VAR tokens share their strings when they are cloned:
+template<> class Token<std::string> : public TokenBase {
+ public:
+  sharedString_t val;
+  Token(const sharedString_t& t, tokType_t type) : TokenBase(type), val(t) {}
+  Token(const Symbol& t, tokType_t type) : TokenBase(type), val(t) {}
+  Token(const std::string& t, tokType_t type) : TokenBase(type), val(t) {}
+  Token(std::string&& t, tokType_t type) : TokenBase(type), val(std::move(t)) {}
+  Token(const char* t, tokType_t type) : TokenBase(type), val(t) {}
+  virtual TokenBase* clone() const {
+    return new Token(*this);
+  }
+};
   
 struct TokenNone : public TokenBase {
   TokenNone() : TokenBase(NONE_Token) {}
@@ -89,6 +236,50 @@ struct TokenUnary : public TokenBase {
     return new TokenUnary(*this);
   }
 };
+
+// A bump allocator for the temporary tokens of an evaluation, e.g.:
+//
+//   Arena arena;
+//   for (const TokenMap& vars : inputs) {
+//     results.push_back(calc.eval(vars, false, &arena));
+//     arena.reset();
+//   }
+//
+// An arena is not thread-safe, so keep one per thread.
+// The tokens returned by an evaluation are always copied
+// to the heap, so they remain valid after reset().
+class Arena {
+  struct block_t {
+    char* data;
+    size_t size;
+  };
+
+  std::vector<block_t> blocks;
+  // The block being used and how much of it was already used:
+  size_t current = 0;
+  size_t used = 0;
+
+ public:
+  static const size_t BLOCK_SIZE = 64 * 1024;
+
+  Arena() {}
+  ~Arena();
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  void* allocate(size_t size);
+
+  // Release everything allocated from it at once, keeping the memory:
+  void reset() { current = used = 0; }
+
+  bool owns(const void* ptr) const;
+};
+
+// Copy a token into `arena`, or to the heap if arena is nullptr.
+// Containers are copied without their content, which they share with
+// `base`. Types that do not know how to be copied into an arena,
+// e.g. functions and iterators, are always cloned to the heap:
+TokenBase* clone(const TokenBase* base, Arena* arena);
   
 class packToken;
 
@@ -104,29 +295,183 @@ public:
 };
 
 
-class OppMap_t {
-  // Set of operators that should be evaluated from right to left:
-  std::set<std::string> RtoL;
-  // Map of operators precedence:
-  std::map<std::string, int> pr_map;
+// Operators are interned into small integer ids the first time they
+// are registered, so the parser and the evaluator can handle them
+// without comparing strings. The ids are shared by all configurations
+// and are never released. The id of ANY_OP is always 0.
+typedef uint32_t opSymbol_t;
+
+struct opSymbols {
+  // Return the id of `op`, interning it if necessary:
+  static opSymbol_t intern(const std::string& op);
+
+  // Return the name of an interned operator (does not lock):
+  static const std::string& name(opSymbol_t op);
+
+  // Return the id of the binary version of a unary operator,
+  // e.g. "L-" => "-", or `op` itself if it is not unary:
+  static opSymbol_t normalize(opSymbol_t op);
+};
+
+// The operators on the RPN, identified by their interned id:
+struct TokenOp : public TokenBase {
+  opSymbol_t op;
+  TokenOp(opSymbol_t op) : TokenBase(OP_Token), op(op) {}
+
+  const std::string& name() const { return opSymbols::name(op); }
+
+  virtual TokenBase* clone() const {
+    return new TokenOp(*this);
+  }
+};
+
+// Saves the value on top of the stack into a slot or loads it back,
+// so a sub-expression is computed only once, see calculator::cse():
+struct TokenSlot : public TokenBase {
+  uint32_t slot;
+  bool save;
+  TokenSlot(uint32_t slot, bool save) : TokenBase(SLOT_Token), slot(slot), save(save) {}
+
+  virtual TokenBase* clone() const {
+    return new TokenSlot(*this);
+  }
+};
+
+// A token of the expression being parsed, pointing into its
+// source buffer, so it is only copied when it is stored:
+struct strView_t {
+  const char* data;
+  size_t size;
+
+  strView_t(const char* data = "", size_t size = 0) : data(data), size(size) {}
+
+  std::string str() const { return std::string(data, size); }
+  const char* end() const { return data + size; }
+};
+
+// A trie over a set of words, compiled into flat arrays, that finds
+// the words at the start of a text without copying it.
+// The edges of each node are stored contiguously, sorted by character.
+//
+// Used by the lexer to look up operators and reserved words,
+// it is rebuilt as a whole whenever a word is added.
+// Missing words are represented by `Value()`.
+template <typename Value>
+class lexTrie_t {
+  struct node_t {
+    uint32_t edges;
+    uint32_t count;
+    Value value;
+  };
+  struct edge_t {
+    char c;
+    uint32_t node;
+  };
+  std::vector<node_t> nodes;
+  std::vector<edge_t> edges;
+
+  typedef typename std::map<std::string, Value>::const_iterator word_it;
+
+  // Build the node for the words on [begin, end), which share their first `depth` characters:
+  uint32_t build(word_it begin, word_it end, size_t depth) {
+    uint32_t id = nodes.size();
+    nodes.push_back({0, 0, Value()});
+    if (begin != end && begin->first.size() == depth) {
+      nodes[id].value = (begin++)->second;
+    }
+
+    // Reserve the edges of this node before building its children:
+    std::vector<word_it> groups;
+    for (word_it it = begin; it != end; ++it) {
+      if (groups.empty() || groups.back()->first[depth] != it->first[depth]) groups.push_back(it);
+    }
+    nodes[id].edges = edges.size();
+    nodes[id].count = groups.size();
+    edges.resize(edges.size() + groups.size());
+
+    for (size_t i = 0; i < groups.size(); ++i) {
+      word_it group_end = (i + 1 < groups.size()) ? groups[i + 1] : end;
+      edges[nodes[id].edges + i].c = groups[i]->first[depth];
+      uint32_t child = build(groups[i], group_end, depth + 1);
+      edges[nodes[id].edges + i].node = child;
+    }
+    return id;
+  }
+
+  // Return the child of `node` through `c`, or 0 if there is none:
+  uint32_t next(uint32_t node, char c) const {
+    const edge_t* edge = &edges[nodes[node].edges];
+    for (uint32_t i = 0; i < nodes[node].count; ++i, ++edge) {
+      if (edge->c == c) return edge->node;
+      if (edge->c > c) break;
+    }
+    return 0;
+  }
 
  public:
-  OppMap_t() {
-    // These operations are hard-coded inside the calculator,
-    // thus their precedence should always be defined:
-    pr_map["[]"] = -1; pr_map["()"] = -1;
-    pr_map["["] = 0x7FFFFFFF; pr_map["("] = 0x7FFFFFFF; pr_map["{"] = 0x7FFFFFFF;
-    RtoL.insert("=");
+  lexTrie_t() { nodes.push_back({0, 0, Value()}); }
+
+  void build(const std::map<std::string, Value>& words) {
+    nodes.clear();
+    edges.clear();
+    build(words.begin(), words.end(), 0);
   }
 
-  void add(const std::string& op, int precedence) {
-    if (precedence < 0) {
-      RtoL.insert(op);
-      precedence = -precedence;
+  // Return the value of the longest word that prefixes `text`, or Value()
+  // if there is none, and store its size on `size`:
+  Value longest(const strView_t& text, size_t* size) const {
+    Value value = Value();
+    *size = 0;
+    uint32_t node = 0;
+    for (size_t i = 0; i < text.size && (node = next(node, text.data[i])); ++i) {
+      if (nodes[node].value != Value()) {
+        value = nodes[node].value;
+        *size = i + 1;
+      }
     }
+    return value;
+  }
 
-    pr_map[op] = precedence;
+  // Return the value of `text` or Value() if it is not a word:
+  Value find(const strView_t& text) const {
+    uint32_t node = 0;
+    for (size_t i = 0; i < text.size; ++i) {
+      if (!(node = next(node, text.data[i]))) return Value();
+    }
+    return nodes[node].value;
   }
+};
+
+// Return a new number on each call, used to tell apart
+// the versions of a config as it is modified:
+uint64_t nextConfigGeneration();
+
+class OppMap_t {
+  struct opInfo_t {
+    int precedence = 0;
+    bool exists = false;
+    // If it should be evaluated from right to left:
+    bool RtoL = false;
+    // The ids of the left and right unary versions of this operator:
+    opSymbol_t left = 0;
+    opSymbol_t right = 0;
+  };
+
+  // Operators information indexed by their ids:
+  std::vector<opInfo_t> info;
+  // Used to find the id of an operator at parsing time:
+  std::map<std::string, opSymbol_t> ids;
+  // The operators that exist, rebuilt by add():
+  lexTrie_t<opSymbol_t> lexer;
+  // Changed by add():
+  uint64_t _generation = nextConfigGeneration();
+
+  opSymbol_t declare(const std::string& op);
+
+ public:
+  OppMap_t();
+
+  void add(const std::string& op, int precedence);
 
   void addUnary(const std::string& op, int precedence) {
     add("L"+op, precedence);
@@ -157,9 +502,35 @@ class OppMap_t {
     }
   }
 
-  int prec(const std::string& op) const { return pr_map.at(op); }
-  bool assoc(const std::string& op) const { return RtoL.count(op); }
-  bool exists(const std::string& op) const { return pr_map.count(op); }
+  // Return the id of the longest operator at the start of `text`,
+  // or 0 if there is none, and store its size on `size`:
+  opSymbol_t longest(const strView_t& text, size_t* size) const {
+    return lexer.longest(text, size);
+  }
+
+  // Return the id of `op` or 0 if it is unknown to this map:
+  opSymbol_t id(const std::string& op) const {
+    auto it = ids.find(op);
+    return it == ids.end() ? 0 : it->second;
+  }
+
+  // Return the id of the unary versions of `op` or 0 if there is none:
+  opSymbol_t leftUnary(opSymbol_t op) const {
+    return op < info.size() ? info[op].left : 0;
+  }
+  opSymbol_t rightUnary(opSymbol_t op) const {
+    return op < info.size() ? info[op].right : 0;
+  }
+
+  int prec(opSymbol_t op) const { return info.at(op).precedence; }
+  bool assoc(opSymbol_t op) const { return op < info.size() && info[op].RtoL; }
+  bool exists(opSymbol_t op) const { return op < info.size() && info[op].exists; }
+
+  int prec(const std::string& op) const { return prec(ids.at(op)); }
+  bool assoc(const std::string& op) const { return assoc(id(op)); }
+  bool exists(const std::string& op) const { return exists(id(op)); }
+
+  uint64_t generation() const { return _generation; }
 };
 
 struct TokenMap;
@@ -172,6 +543,58 @@ class Function;
 class packToken {
   TokenBase* base;
 
+  // None, unary, bool, int and real values are stored on this
+  // buffer instead of on the heap, so creating and copying them
+  // never allocates. Any other type is cloned to the heap:
+  typename std::aligned_storage<sizeof(Token<double>),
+                                alignof(Token<double>)>::type storage;
+
+  bool isInline() const {
+    return static_cast<const void*>(base) == static_cast<const void*>(&storage);
+  }
+
+  // Set `base` to a copy of `t`, stored inline if possible:
+  void store(const TokenBase* t) {
+    switch (t->type) {
+    case NONE_Token:
+      base = new (&storage) TokenNone();
+      break;
+    case UNARY_Token:
+      base = new (&storage) TokenUnary();
+      break;
+    case REAL_Token:
+      base = new (&storage) Token<double>(static_cast<const Token<double>*>(t)->val, REAL_Token);
+      break;
+    case INT_Token:
+      base = new (&storage) Token<int64_t>(static_cast<const Token<int64_t>*>(t)->val, INT_Token);
+      break;
+    case BOOL_Token:
+      base = new (&storage) Token<uint8_t>(static_cast<const Token<uint8_t>*>(t)->val, BOOL_Token);
+      break;
+    default:
+      base = t->clone();
+    }
+  }
+
+  // Take the token of `t`, leaving it in the same state as release():
+  void take(packToken* t) {
+    if (t->isInline()) {
+      store(t->base);
+      t->destroy();
+    } else {
+      base = t->base;
+    }
+    t->base = 0;
+  }
+
+  void destroy() {
+    if (isInline()) {
+      base->~TokenBase();
+    } else {
+      delete base;
+    }
+  }
+
  public:
   static const packToken& None();
 
@@ -179,26 +602,28 @@ class packToken {
   static strFunc_t& str_custom();
 
  public:
-  packToken() : base(new TokenNone()) {}
-  packToken(const TokenBase& t) : base(t.clone()) {}
-  packToken(const packToken& t) : base(t.base->clone()) {}
-  packToken(packToken&& t) : base(t.base) { t.base = 0; }
+  packToken() : base(new (&storage) TokenNone()) {}
+  packToken(const TokenBase& t) { store(&t); }
+  packToken(const packToken& t) { store(t.base); }
+  packToken(packToken&& t) { take(&t); }
   packToken& operator=(const packToken& t);
+  packToken& operator=(packToken&& t);
 
   template<class C>
   packToken(C c, tokType type) : base(new Token<C>(c, type)) {}
-  packToken(int i) : base(new Token<int64_t>(i, INT_Token)) {}
-  packToken(int64_t l) : base(new Token<int64_t>(l, INT_Token)) {}
-  packToken(bool b) : base(new Token<uint8_t>(b, BOOL_Token)) {}
-  packToken(size_t s) : base(new Token<int64_t>(s, INT_Token)) {}
-  packToken(float f) : base(new Token<double>(f, REAL_Token)) {}
-  packToken(double d) : base(new Token<double>(d, REAL_Token)) {}
+  packToken(int i) : base(new (&storage) Token<int64_t>(i, INT_Token)) {}
+  packToken(int64_t l) : base(new (&storage) Token<int64_t>(l, INT_Token)) {}
+  packToken(bool b) : base(new (&storage) Token<uint8_t>(b, BOOL_Token)) {}
+  packToken(size_t s) : base(new (&storage) Token<int64_t>(s, INT_Token)) {}
+  packToken(float f) : base(new (&storage) Token<double>(f, REAL_Token)) {}
+  packToken(double d) : base(new (&storage) Token<double>(d, REAL_Token)) {}
   packToken(const void* p) : base(new Token<const void *>(p, POINT_Token)) {}
   packToken(const char* s) : base(new Token<std::string>(s, STR_Token)) {}
   packToken(const std::string& s) : base(new Token<std::string>(s, STR_Token)) {}
+  packToken(const Symbol& s) : base(new Token<std::string>(s, STR_Token)) {}
   packToken(const TokenMap& map);
   packToken(const TokenList& list);
-  ~packToken() { delete base; }
+  ~packToken() { destroy(); }
 
   TokenBase* operator->() const;
   bool operator==(const packToken& t) const;
@@ -213,7 +638,9 @@ class packToken {
   bool asBool() const;
   double asDouble() const;
   int64_t asInt() const;
-  std::string& asString() const;
+  const std::string& asString() const;
+  // Copies the string first if other tokens share it:
+  std::string& asString();
   TokenMap& asMap() const;
   TokenList& asList() const;
   Tuple& asTuple() const;
@@ -245,6 +672,10 @@ class packToken {
   // The intance whose pointer was removed must be an rvalue.
   TokenBase* release() && {
     TokenBase* b = base;
+    if (isInline()) {
+      b = base->clone();
+      base->~TokenBase();
+    }
     // Setting base to 0 leaves the class in an invalid state,
     // except for destruction.
     base = 0;
@@ -294,6 +725,7 @@ struct Container {
  public:
   Container() : ref(std::make_shared<T>()) {}
   Container(const T& t) : ref(std::make_shared<T>(t)) {}
+  Container(T&& t) : ref(std::make_shared<T>(std::move(t))) {}
 
  public:
   operator T*() const { return ref.get(); }
@@ -326,7 +758,121 @@ struct Iterator : public Iterable {
 };
 
 struct TokenMap;
-typedef std::map<std::string, packToken> TokenMap_t;
+
+// The entries of a TokenMap, iterated in insertion order.
+//
+// The keys are interned Symbols, so looking up a Symbol only compares
+// pointers. The lookups by string compare the hashes before the strings
+// and never intern the key.
+//
+// Small maps are searched linearly, and past HASH_THRESHOLD entries
+// an open addressing hash index is built over them. The entries live
+// on blocks that are never moved, so, as with std::map, inserting a
+// key does not invalidate the references to the other values.
+// The first block is stored inline, so small maps never allocate it.
+class TokenMap_t {
+ public:
+  typedef std::pair<Symbol, packToken> value_type;
+  static const size_t HASH_THRESHOLD = 8;
+
+  template <typename Map, typename Value>
+  class iterator_t {
+    Map* map = 0;
+    size_t i = 0;
+
+    template <typename M, typename V> friend class iterator_t;
+
+   public:
+    iterator_t() {}
+    iterator_t(Map* map, size_t i) : map(map), i(i) {}
+
+    // Allow converting an iterator into a const_iterator:
+    template <typename M, typename V>
+    iterator_t(const iterator_t<M, V>& other) : map(other.map), i(other.i) {}
+
+    Value& operator*() const { return map->at(i); }
+    Value* operator->() const { return &map->at(i); }
+    iterator_t& operator++() { i = map->next(i + 1); return *this; }
+    iterator_t operator++(int) { iterator_t copy = *this; ++*this; return copy; }
+    bool operator==(const iterator_t& other) const { return i == other.i && map == other.map; }
+    bool operator!=(const iterator_t& other) const { return !(*this == other); }
+
+    size_t position() const { return i; }
+  };
+
+  typedef iterator_t<TokenMap_t, value_type> iterator;
+  typedef iterator_t<const TokenMap_t, const value_type> const_iterator;
+
+ private:
+  // The first block holds FIRST_BLOCK entries and each
+  // following one twice as many as the previous:
+  static const size_t FIRST_BLOCK = 4;
+  value_type first_block[FIRST_BLOCK];
+  std::vector<std::unique_ptr<value_type[]>> blocks;
+
+  value_type* block(size_t k) { return k ? blocks[k-1].get() : first_block; }
+  const value_type* block(size_t k) const { return k ? blocks[k-1].get() : first_block; }
+
+  // Erased entries are left on their blocks as tombstones with
+  // a null key, until they outnumber the `count_` live ones.
+  // `used_` entries are taken and the first live one is at `first_`:
+  size_t count_ = 0;
+  size_t used_ = 0;
+  size_t first_ = 0;
+
+  // Empty slots have entry == 0, the others hold the position + 1
+  // of an entry and the hash of its key:
+  struct slot_t {
+    size_t hash;
+    size_t entry;
+  };
+  std::vector<slot_t> index;
+
+  template <typename Equal>
+  size_t lookup(size_t hash, Equal equal) const;
+  size_t lookup(const Symbol& key) const;
+  size_t lookup(const std::string& key) const;
+  void reindex();
+  void index_insert(size_t hash, size_t entry);
+  void index_erase(size_t entry);
+  size_t next(size_t i) const;
+  packToken& append(const Symbol& key);
+  size_t remove(size_t i, size_t pos);
+  size_t compact(size_t pos);
+
+ public:
+  TokenMap_t() {}
+  TokenMap_t(const TokenMap_t& other) { *this = other; }
+  TokenMap_t& operator=(const TokenMap_t& other);
+
+  value_type& at(size_t i);
+  const value_type& at(size_t i) const;
+
+  size_t size() const { return count_; }
+  bool empty() const { return count_ == 0; }
+  void clear();
+
+  iterator begin() { return iterator(this, first_); }
+  iterator end() { return iterator(this, used_); }
+  const_iterator begin() const { return const_iterator(this, first_); }
+  const_iterator end() const { return const_iterator(this, used_); }
+
+  iterator find(const Symbol& key) { return iterator(this, lookup(key)); }
+  const_iterator find(const Symbol& key) const { return const_iterator(this, lookup(key)); }
+  iterator find(const std::string& key) { return iterator(this, lookup(key)); }
+  const_iterator find(const std::string& key) const { return const_iterator(this, lookup(key)); }
+  size_t count(const Symbol& key) const { return lookup(key) != used_; }
+  size_t count(const std::string& key) const { return lookup(key) != used_; }
+
+  // Inserting keys never moves the other values:
+  packToken& operator[](const Symbol& key);
+  packToken& operator[](const std::string& key);
+
+  // Erasing costs O(1) amortized, but it might move the other
+  // values, and invalidate the iterators, when it compacts them:
+  iterator erase(iterator it);
+  size_t erase(const std::string& key);
+};
 
 struct MapData_t {
   TokenMap_t map;
@@ -391,6 +937,8 @@ struct TokenMap : public Container<MapData_t>, public Iterable {
   }
 
  public:
+  packToken* find(const Symbol& key);
+  const packToken* find(const Symbol& key) const;
   packToken* find(const std::string& key);
   const packToken* find(const std::string& key) const;
   TokenMap* findMap(const std::string& key);
@@ -399,6 +947,7 @@ struct TokenMap : public Container<MapData_t>, public Iterable {
 
   TokenMap getChild();
 
+  packToken& operator[](const Symbol& key);
   packToken& operator[](const std::string& str);
 
   void erase(std::string key);
@@ -449,7 +998,7 @@ struct TokenList : public Container<TokenList_t>, public Iterable {
     return list()[idx];
   }
 
-  void push(packToken val) const { list().push_back(val); }
+  void push(packToken val) const { list().push_back(std::move(val)); }
   packToken pop() const {
     packToken back = list().back();
     list().pop_back();
@@ -521,11 +1070,21 @@ class STuple : public Tuple {
 };
 #pragma endregion
 
+// The classes of the characters read by the lexer. They are looked
+// up on an ASCII table, so they don't depend on the current locale,
+// and the non ASCII characters belong to no class:
+enum charClass_t : uint8_t {
+  SPACE_CHAR = 0x1,  // ' ', '\t', '\n', '\v', '\f' and '\r'
+  DIGIT_CHAR = 0x2,  // 0-9
+  VAR_CHAR = 0x4,    // Letters and '_', that might start a variable name
+  OP_CHAR = 0x8      // Punctuation that might continue an operator
+};
+
 // This struct was created to expose internal toRPN() variables
 // to custom parsers, in special to the rWordParser_t functions.
 struct rpnBuilder {
   TokenQueue_t rpn;
-  std::stack<std::string> opStack;
+  std::stack<opSymbol_t> opStack;
   uint8_t lastTokenWasOp = true;
   bool lastTokenWasUnary = false;
   TokenMap scope;
@@ -542,35 +1101,50 @@ struct rpnBuilder {
   static void cleanRPN(TokenQueue_t* rpn);
 
  public:
-  void handle_op(const std::string& op);
+  void handle_op(opSymbol_t op);
+  void handle_op(const std::string& op) { handle_op(opp.id(op)); }
   void handle_token(TokenBase* token);
   void open_bracket(const std::string& bracket);
   void close_bracket(const std::string& bracket);
 
   // * * * * * Static parsing helpers: * * * * * //
 
+  // The charClass_t flags of each ASCII character:
+  static const uint8_t charClass[256];
+
+  static inline bool is(const char c, uint8_t mask) {
+    return charClass[static_cast<uint8_t>(c)] & mask;
+  }
+
   // Check if a character is the first character of a variable:
   static inline bool isvarchar(const char c) {
-    return isalpha(c) || c == '_';
+    return is(c, VAR_CHAR);
+  }
+
+  // Return the variable name at the start of `expr`, without copying it:
+  static inline strView_t scanVar(const char* expr) {
+    const char* end = expr + 1;
+    while (is(*end, VAR_CHAR | DIGIT_CHAR)) ++end;
+    return strView_t(expr, end - expr);
   }
 
   static inline std::string parseVar(const char* expr, const char** rest = 0) {
-    std::stringstream ss;
-    ss << *expr;
-    ++expr;
-    while (rpnBuilder::isvarchar(*expr) || isdigit(*expr)) {
-      ss << *expr;
-      ++expr;
-    }
-    if (rest) *rest = expr;
-    return ss.str();
+    strView_t name = scanVar(expr);
+    if (rest) *rest = name.end();
+    return name.str();
   }
 
+  // Parse the number at the start of `expr` in a single pass, regardless
+  // of the current locale: an integer in decimal, octal (e.g. 017) or
+  // hex (e.g. 0x1F) notation, or a real number (e.g. 1.5 or 2e-3).
+  // Returns a new INT or REAL token, integers saturate at INT64_MAX:
+  static TokenBase* parseNumber(const char* expr, const char** rest = 0);
+
  private:
-  void handle_opStack(const std::string& op);
-  void handle_binary(const std::string& op);
-  void handle_left_unary(const std::string& op);
-  void handle_right_unary(const std::string& op);
+  void handle_opStack(opSymbol_t op);
+  void handle_binary(opSymbol_t op);
+  void handle_left_unary(opSymbol_t op);
+  void handle_right_unary(opSymbol_t op);
 };
 
 class RefToken;
@@ -586,10 +1160,19 @@ struct evaluationData {
   std::string op;
   opID_t opID;
 
-  evaluationData(TokenQueue_t rpn, const TokenMap &scope, const opMap_t& opMap)
+  // The arena used for the temporary tokens, if any:
+  Arena* arena = 0;
+
+  evaluationData(const TokenQueue_t& rpn, const TokenMap &scope, const opMap_t& opMap)
     : rpn(rpn), scope(scope), opMap(opMap), opID(0)
   {
   }
+
+  evaluationData(TokenQueue_t&& rpn, const TokenMap &scope, const opMap_t& opMap)
+    : rpn(std::move(rpn)), scope(scope), opMap(opMap), opID(0) {}
+
+  evaluationData(const TokenMap &scope, const opMap_t& opMap)
+    : scope(scope), opMap(opMap), opID(0) {}
 };
 
 // The reservedWordParser_t is the function type called when
@@ -606,14 +1189,19 @@ struct parserMap_t {
   // Add reserved word:
   void add(const std::string& word, rWordParser_t* parser) {
     wmap[word] = parser;
+    words.build(wmap);
+    _generation = nextConfigGeneration();
   }
 
   // Add reserved character:
   void add(char c, rWordParser_t* parser) {
     cmap[c] = parser;
+    _generation = nextConfigGeneration();
   }
 
-  rWordParser_t* find(const std::string text) const {
+  uint64_t generation() const { return _generation; }
+
+  rWordParser_t* find(const std::string& text) const {
     const auto w_it = wmap.find(text);
     if (w_it != wmap.end()) {
       return w_it->second;
@@ -621,6 +1209,16 @@ struct parserMap_t {
     return nullptr;
   }
 
+  // Find a word on the source buffer, without copying it:
+  rWordParser_t* find(const strView_t& text) const {
+    return words.find(text);
+  }
+
+  // Find the longest reserved word at the start of `text`:
+  rWordParser_t* longest(const strView_t& text, size_t* size) const {
+    return words.longest(text, size);
+  }
+
   rWordParser_t* find(char c) const {
     const rCharMap_t::const_iterator c_it = cmap.find(c);
     if (c_it != cmap.end()) {
@@ -628,6 +1226,12 @@ struct parserMap_t {
     }
     return nullptr;
   }
+
+ private:
+  // The words on `wmap`, rebuilt by add():
+  lexTrie_t<rWordParser_t*> words;
+  // Changed by add():
+  uint64_t _generation = nextConfigGeneration();
 };
 
 // The RefToken keeps information about the context
@@ -645,7 +1249,10 @@ class RefToken : public TokenBase {
   RefToken(packToken k = packToken::None(), packToken v = packToken::None(), packToken m = packToken::None()) :
     TokenBase(v->type | REF_Token), original_value(std::forward<packToken>(v)), key(std::forward<packToken>(k)), origin(std::forward<packToken>(m)) {}
 
-  TokenBase* resolve(TokenMap* localScope = 0) const {
+  // The value it had when it was created:
+  const packToken& value() const { return original_value; }
+
+  TokenBase* resolve(TokenMap* localScope = 0, Arena* arena = 0) const {
     TokenBase* result = 0;
 
     // Local variables have no origin == NONE,
@@ -654,12 +1261,12 @@ class RefToken : public TokenBase {
       // Get the most recent value from the local scope:
       packToken* r_value = localScope->find(key.asString());
       if (r_value) {
-        result = (*r_value)->clone();
+        result = cparse::clone(r_value->token(), arena);
       }
     }
 
     // In last case return the compilation-time value:
-    return result ? result : original_value->clone();
+    return result ? result : cparse::clone(original_value.token(), arena);
   }
 
   virtual TokenBase* clone() const {
@@ -683,6 +1290,21 @@ class Operation {
   // Without stoping the operation matching process.
   // struct Reject : public std::exception {};
 
+ public:
+  // Flags describing an operation:
+  enum flags_t : uint8_t {
+    // Its result depends only on the values of its operands,
+    // i.e. it has no side effects and does not use `data`
+    // except for `data->op`. These operations may be
+    // evaluated at compile time by calculator::fold():
+    PURE = 0x1,
+    // It never reads `data->left` or `data->right`, so its
+    // operands do not need to be wrapped in RefTokens.
+    // Programs should be compiled again after registering
+    // operations without it on the operators they use:
+    NO_REFS = 0x2
+  };
+
  public:
   static inline uint32_t mask(tokType_t type);
   static opID_t build_mask(tokType_t left, tokType_t right);
@@ -690,13 +1312,16 @@ class Operation {
  private:
   opID_t _mask;
   opFunc_t _exec;
+  uint8_t _flags;
 
  public:
-  Operation(opSignature_t sig, opFunc_t func)
-           : _mask(build_mask(sig.left, sig.right)), _exec(func) {}
+  Operation(opSignature_t sig, opFunc_t func, uint8_t flags = 0)
+           : _mask(build_mask(sig.left, sig.right)), _exec(func), _flags(flags) {}
 
  public:
   opID_t getMask() const { return _mask; }
+  opFunc_t getFunc() const { return _exec; }
+  uint8_t getFlags() const { return _flags; }
   packToken exec(const packToken& left, const packToken& right,
                  evaluationData* data) const {
     return _exec(left, right, data);
@@ -705,9 +1330,173 @@ class Operation {
 
 typedef std::map<tokType_t, TokenMap> typeMap_t;
 typedef std::vector<Operation> opList_t;
+
+// Apply an operation to `size` pairs of numbers at once,
+// `result` may be the same array as `left`:
+typedef void (*batchFunc_t)(const double* left, const double* right,
+                            double* result, size_t size);
+
+struct batchKernel_t {
+  batchFunc_t func;
+  // The type of the values it produces:
+  tokType_t type;
+};
+
+// The frozen form of an opMap_t used by the evaluator.
+//
+// It maps an operator id and the types of both operands directly
+// to the function that should be executed, so dispatching an
+// operation costs no string comparisons nor mask matching.
+struct opDispatch_t {
+  // Types are grouped in classes of types that match
+  // exactly the same set of operation signatures:
+  uint8_t typeClass[256];
+  uint32_t classes;
+
+  // The offset on `entries` of the table used by each operator id.
+  // Operators without operations or kernels of their own use the
+  // table at offset 0, which only matches the ANY_OP operations:
+  std::vector<uint32_t> tables;
+
+  // One table of `classes * classes` entries per operator with a table.
+  // Each entry is an index on `funcs` plus one or 0 if no operation matches:
+  std::vector<uint16_t> entries;
+  std::vector<Operation::opFunc_t> funcs;
+  std::vector<uint8_t> flags;
+
+  // The batch kernel of each function on `funcs`, if any:
+  std::vector<batchKernel_t> batchKernels;
+
+  opDispatch_t() : typeClass(), classes(1), entries(1) {}
+
+  Operation::opFunc_t find(opSymbol_t op, tokType_t left, tokType_t right) const {
+    uint32_t table = op < tables.size() ? tables[op] : 0;
+    uint16_t entry = entries[table + typeClass[left] * classes + typeClass[right]];
+    return entry ? funcs[entry-1] : nullptr;
+  }
+
+  // Same as find() but also return the Operation::flags_t of the operation:
+  Operation::opFunc_t find(opSymbol_t op, tokType_t left, tokType_t right,
+                           uint8_t* flags) const {
+    uint32_t table = op < tables.size() ? tables[op] : 0;
+    uint16_t entry = entries[table + typeClass[left] * classes + typeClass[right]];
+    *flags = entry ? this->flags[entry-1] : 0;
+    return entry ? funcs[entry-1] : nullptr;
+  }
+
+  // Whether every operation that might be dispatched for `op` is PURE:
+  bool isPure(opSymbol_t op) const {
+    uint32_t table = op < tables.size() ? tables[op] : 0;
+    for (uint32_t i = 0; i < classes * classes; ++i) {
+      uint16_t entry = entries[table + i];
+      if (entry && !(flags[entry-1] & Operation::PURE)) return false;
+    }
+    return true;
+  }
+
+  // Whether any operation that might be dispatched for `op`
+  // reads the references of its operands, see Operation::NO_REFS:
+  bool usesRefs(opSymbol_t op) const {
+    uint32_t table = op < tables.size() ? tables[op] : 0;
+    for (uint32_t i = 0; i < classes * classes; ++i) {
+      uint16_t entry = entries[table + i];
+      if (entry && !(flags[entry-1] & Operation::NO_REFS)) return true;
+    }
+    return false;
+  }
+
+  // Return the operation dispatched for `op` if it is the same
+  // for every pair of operand types, or nullptr otherwise:
+  Operation::opFunc_t findUnique(opSymbol_t op, uint8_t* flags) const {
+    uint32_t table = op < tables.size() ? tables[op] : 0;
+    uint16_t entry = entries[table];
+    for (uint32_t i = 1; i < classes * classes; ++i) {
+      if (entries[table + i] != entry) return nullptr;
+    }
+    *flags = entry ? this->flags[entry-1] : 0;
+    return entry ? funcs[entry-1] : nullptr;
+  }
+
+  // Return the Operation::flags_t of the operation dispatched for these operands:
+  uint8_t findFlags(opSymbol_t op, tokType_t left, tokType_t right) const {
+    uint32_t table = op < tables.size() ? tables[op] : 0;
+    uint16_t entry = entries[table + typeClass[left] * classes + typeClass[right]];
+    return entry ? flags[entry-1] : 0;
+  }
+
+  const batchKernel_t* findBatch(opSymbol_t op, tokType_t left, tokType_t right) const {
+    uint32_t table = op < tables.size() ? tables[op] : 0;
+    uint16_t entry = entries[table + typeClass[left] * classes + typeClass[right]];
+    return entry && batchKernels[entry-1].func ? &batchKernels[entry-1] : nullptr;
+  }
+};
+
 struct opMap_t : public std::map<std::string, opList_t> {
-  void add(const opSignature_t sig, Operation::opFunc_t func) {
-    (*this)[sig.op].push_back(Operation(sig, func));
+  typedef std::map<std::string, opList_t> map_t;
+
+  opMap_t() {}
+  opMap_t(const opMap_t& other)
+    : map_t(other), kernels(other.kernels), batchKernels(other.batchKernels) {}
+  opMap_t& operator=(const opMap_t& other) {
+    map_t::operator=(other);
+    kernels = other.kernels;
+    batchKernels = other.batchKernels;
+    touch();
+    return *this;
+  }
+
+  void add(const opSignature_t sig, Operation::opFunc_t func, uint8_t flags = 0) {
+    (*this)[sig.op].push_back(Operation(sig, func, flags));
+  }
+
+  // The accessors that might modify the operations mark the dispatch
+  // table to be rebuilt, so the references they return should not be
+  // kept after the next call to dispatch():
+  opList_t& operator[](const std::string& op) { touch(); return map_t::operator[](op); }
+  opList_t& at(const std::string& op) { touch(); return map_t::at(op); }
+  const opList_t& at(const std::string& op) const { return map_t::at(op); }
+  iterator find(const std::string& op) { touch(); return map_t::find(op); }
+  const_iterator find(const std::string& op) const { return map_t::find(op); }
+  iterator begin() { touch(); return map_t::begin(); }
+  const_iterator begin() const { return map_t::begin(); }
+  iterator end() { touch(); return map_t::end(); }
+  const_iterator end() const { return map_t::end(); }
+  std::pair<iterator, bool> insert(const value_type& value) {
+    touch();
+    return map_t::insert(value);
+  }
+  size_type erase(const std::string& op) { touch(); return map_t::erase(op); }
+  iterator erase(const_iterator it) { touch(); return map_t::erase(it); }
+  void clear() { touch(); map_t::clear(); }
+
+  // Register a specialized version of `func` to be executed instead
+  // of it whenever `func` is the operation dispatched for `op`,
+  // e.g. a kernel that only knows how to sum two numbers.
+  void addKernel(Operation::opFunc_t func, const std::string& op,
+                 Operation::opFunc_t kernel) {
+    kernels[std::make_pair(func, op)] = kernel;
+    touch();
+  }
+
+  // The table is rebuilt on the first call after the operations change:
+  const opDispatch_t& dispatch() const {
+    if (dirty.load(std::memory_order_acquire)) freeze();
+    return _dispatch;
+  }
+
+  // Changes each time the operations might have changed:
+  uint64_t generation() const { return _generation; }
+
+  // Register a version of `func` that applies it to whole columns
+  // of numbers, used by calculator::eval_batch() whenever `func` is
+  // dispatched for numeric operands. The values it produces are
+  // of the given type, i.e. REAL_Token or BOOL_Token.
+  //
+  // They are also used by Program::exec() to evaluate
+  // numeric expressions without boxing their values.
+  void addBatchKernel(Operation::opFunc_t func, batchFunc_t kernel, tokType_t type) {
+    batchKernels[func] = {kernel, type};
+    touch();
   }
 
   std::string str() const {
@@ -721,6 +1510,24 @@ struct opMap_t : public std::map<std::string, opList_t> {
     result.pop_back();
     return result + " }";
   }
+
+ private:
+  void touch() {
+    dirty.store(true, std::memory_order_release);
+    _generation = nextConfigGeneration();
+  }
+
+  // Rebuild the dispatch table if it is dirty:
+  void freeze() const;
+
+ private:
+  std::map<std::pair<Operation::opFunc_t, std::string>, Operation::opFunc_t> kernels;
+  std::map<Operation::opFunc_t, batchKernel_t> batchKernels;
+  uint64_t _generation = nextConfigGeneration();
+
+  mutable opDispatch_t _dispatch;
+  mutable std::atomic<bool> dirty{true};
+  mutable std::mutex freezing;
 };
 
 struct Config_t {
@@ -731,8 +1538,299 @@ struct Config_t {
   Config_t() {}
   Config_t(parserMap_t p, OppMap_t opp, opMap_t opMap)
           : parserMap(p), opPrecedence(opp), opMap(opMap) {}
+
+  // Changes whenever the config is modified with add() or through the opMap:
+  std::string generation() const {
+    uint64_t gens[3] = { parserMap.generation(), opPrecedence.generation(),
+                         opMap.generation() };
+    return std::string(reinterpret_cast<const char*>(gens), sizeof(gens));
+  }
+};
+
+#pragma region Program
+
+// The instruction set of a compiled Program:
+enum opCode_t : uint8_t {
+  // Push a copy of `constants[arg]` into the stack:
+  PUSH_CONST,
+  // Push the value of the variable `names[arg]`:
+  PUSH_VAR,
+  // Apply the operator whose opSymbol_t is `arg` to the 2 values on top of the stack:
+  APPLY_OP,
+  // Same as APPLY_OP but for the "()" operator, i.e. a function call:
+  CALL_OP,
+  // Save a copy of the value on top of the stack on the slot `arg`:
+  SAVE_SLOT,
+  // Push a copy of the value saved on the slot `arg`:
+  LOAD_SLOT,
+  // Push the value of the variable bound to the schema slot `arg`:
+  PUSH_ARG
+};
+
+// Instructions are fixed-size records, stored contiguously on
+// Program::code, with their operands on the side tables:
+struct Instruction {
+  opCode_t code;
+  // Set by Program::compile() on the PUSH_VAR and PUSH_CONST instructions
+  // whose values are used by operations that read their references.
+  // The others push plain values instead of RefTokens:
+  bool ref = true;
+  uint32_t arg;
+  Instruction(opCode_t code, uint32_t arg = 0) : code(code), arg(arg) {}
+};
+static_assert(sizeof(Instruction) == 8, "Instructions should fit in 8 bytes");
+
+// The ordered list of variables a calculator is bound to with
+// calculator::bind(): each variable is read from the slot with
+// the same index on the arrays passed to eval().
+//
+// The types are optional, e.g. `Schema().add("x", REAL_Token)`,
+// and are only used as hints by the compiler.
+struct Schema {
+  struct field_t {
+    std::string name;
+    tokType_t type;
+  };
+  std::vector<field_t> fields;
+
+  Schema() {}
+  Schema(std::initializer_list<std::string> names) {
+    for (const std::string& name : names) add(name);
+  }
+
+  Schema& add(const std::string& name, tokType_t type = ANY_TYPE_Token) {
+    fields.push_back({name, type});
+    return *this;
+  }
+
+  // Returns the slot of `name` or -1 if it is not on the schema:
+  int32_t find(const std::string& name) const {
+    for (size_t i = 0; i < fields.size(); ++i) {
+      if (fields[i].name == name) return i;
+    }
+    return -1;
+  }
+
+  size_t size() const { return fields.size(); }
+};
+
+// A Program is the compiled form of an RPN: a flat list of
+// instructions plus the tables of constants and variable
+// names referenced by them.
+//
+// It is built once by calculator::compile() and is never modified
+// by exec(), so the same Program can be executed repeatedly without
+// copying or cloning its instructions.
+struct Program {
+  std::vector<Instruction> code;
+  std::vector<packToken> constants;
+  std::vector<Symbol> names;
+  // The names of the schema slots read by PUSH_ARG:
+  std::vector<Symbol> args;
+
+  // Maximum number of values on the stack during exec():
+  uint32_t depth = 0;
+  // Number of slots used by SAVE_SLOT and LOAD_SLOT:
+  uint32_t slots = 0;
+
+  // Set by compile() when type inference shows the program only
+  // applies operators to numbers, given that its variables are numbers.
+  // exec() then tries to evaluate it on a stack of plain doubles
+  // and falls back to the generic evaluation if any variable or
+  // operation turns out not to be numeric.
+  bool numeric = false;
+  // The value inferred by compile(), before bind() checked the
+  // types of the schema:
+  bool inferred_numeric = false;
+  static const uint32_t MAX_NUMERIC_DEPTH = 32;
+
+ public:
+  static Program compile(const TokenQueue_t& rpn, const Config_t& config);
+
+  // Replace the PUSH_VAR instructions of the variables
+  // on `schema` by PUSH_ARG instructions, undoing any previous
+  // binding. An empty schema unbinds every variable:
+  void bind(const Schema& schema);
+
+  // The instructions in RPN order, e.g. "x, 2, *":
+  std::string str() const;
+
+  // Returns the resulting token, owned by the caller,
+  // or nullptr if the evaluation failed.
+  // The temporary tokens are allocated from `arena` if provided.
+  //
+  // The values of the PUSH_ARG instructions are read from `args`,
+  // indexed by slot, or looked up by name on `scope` if it is null.
+  TokenBase* exec(const TokenMap& scope, const Config_t& config, Arena* arena = 0,
+                  const packToken* args = 0) const;
+
+ private:
+  TokenBase* exec_numeric(const TokenMap& scope, const opDispatch_t& dispatch,
+                          const packToken* args) const;
+};
+
+// A bounded cache of compiled Programs, keyed by the expression and
+// the config it is compiled with, that evicts the least recently used
+// ones first. It is thread-safe. The static calculator::calculate()
+// uses the one returned by calculator::cache() when asked to.
+//
+// The Programs are compiled on an empty scope, so they can be executed
+// on any scope. Expressions whose compilation depends on the variables,
+// e.g. because of a reserved word parser that reads rpnBuilder::scope,
+// should not be cached. The key includes the config generation(), so
+// the entries compiled before a config change are never returned.
+class ProgramCache {
+ public:
+  struct stats_t {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+  };
+
+  static const size_t DEFAULT_CAPACITY = 1024;
+
+ private:
+  struct entry_t {
+    std::string key;
+    std::shared_ptr<const Program> program;
+    // The size of the expression, as read by toRPN():
+    size_t size;
+  };
+
+  mutable std::mutex mutex;
+  // The most recently used entries first:
+  std::list<entry_t> entries;
+  std::unordered_map<std::string, std::list<entry_t>::iterator> index;
+  size_t _capacity;
+  stats_t _stats;
+
+  void evict();
+
+ public:
+  explicit ProgramCache(size_t capacity = DEFAULT_CAPACITY) : _capacity(capacity) {}
+  ProgramCache(const ProgramCache&) = delete;
+  ProgramCache& operator=(const ProgramCache&) = delete;
+
+  // Return the Program of `expr`, compiling it on a miss, and set
+  // `rest` to the end of the expression. Returns nullptr if the
+  // capacity is 0, i.e. if the cache is disabled:
+  std::shared_ptr<const Program> get(const char* expr, const char** rest,
+                                     const Config_t& config);
+
+  // Changing the capacity evicts the entries that no longer fit:
+  void set_capacity(size_t capacity);
+  size_t capacity() const;
+  size_t size() const;
+
+  stats_t stats() const;
+  // Remove all the entries, e.g. after changing a config:
+  void clear();
 };
 
+#pragma endregion
+
+#pragma region Closure
+
+struct closureContext_t;
+
+// A node of a ClosureProgram.
+//
+// Each node is evaluated by calling its `eval` function, which
+// is chosen at compile time according to the kind of the node,
+// and returns the resulting token owned by the caller,
+// or nullptr if the evaluation failed.
+struct ClosureNode {
+  typedef TokenBase* (*evalFunc_t)(const ClosureNode* node, closureContext_t* ctx);
+  typedef bool (*numFunc_t)(const ClosureNode* node, closureContext_t* ctx,
+                            double* value, tokType_t* type);
+
+  evalFunc_t eval = 0;
+
+  // Evaluate it on unboxed numbers like Program::exec_numeric() does.
+  // Returns false if any value or operation turns out not to be numeric:
+  numFunc_t eval_numeric = 0;
+  const ClosureNode* left = 0;
+  const ClosureNode* right = 0;
+
+  // The constant, variable or slot used by the node,
+  // or the opSymbol_t of the operator it applies:
+  uint32_t arg = 0;
+
+  // The operation bound at compile time when it does not depend
+  // on the types of the operands, otherwise it is dispatched
+  // when the node is evaluated:
+  Operation::opFunc_t func = 0;
+  uint8_t flags = 0;
+};
+
+// An alternative to Program::exec() where the expression is compiled
+// into a tree of pre-bound callables: each node holds pointers to its
+// children and evaluating it is a chain of indirect calls, with no
+// instruction loop and no stack of intermediate values.
+//
+// Selected per calculator with calculator::set_engine().
+class ClosureProgram {
+  std::vector<ClosureNode> nodes;
+  std::vector<packToken> constants;
+  std::vector<Symbol> names;
+  std::vector<Symbol> args;
+  uint32_t slots = 0;
+  // Same as Program::numeric:
+  bool numeric = false;
+  // The opMap generation() the operations were bound with:
+  uint64_t generation = 0;
+
+  friend struct closureContext_t;
+
+ public:
+  ClosureProgram() {}
+  ClosureProgram(const ClosureProgram& other) { *this = other; }
+  ClosureProgram& operator=(const ClosureProgram& other);
+
+  // Moving the nodes keeps their addresses:
+  ClosureProgram(ClosureProgram&& other) = default;
+  ClosureProgram& operator=(ClosureProgram&& other) = default;
+
+  // Operations are bound using the operators of `config`. If it is
+  // executed after the opMap changes, or with another config, they
+  // are dispatched on each evaluation instead, like Program::exec().
+  static ClosureProgram compile(const Program& program, const Config_t& config);
+
+  // Same as Program::exec():
+  TokenBase* exec(const TokenMap& scope, const Config_t& config, Arena* arena = 0,
+                  const packToken* args = 0) const;
+};
+
+#pragma endregion
+
+#pragma region Batch
+
+// The values of one variable for each row of a batch.
+//
+// It only points to the values, so they must
+// outlive the calls to calculator::eval_batch():
+struct Column {
+  // One of REAL_Token, INT_Token, BOOL_Token or STR_Token:
+  tokType_t type;
+  const void* data;
+  size_t size;
+
+  Column() : type(NONE_Token), data(0), size(0) {}
+  Column(const double* values, size_t size) : type(REAL_Token), data(values), size(size) {}
+  Column(const int64_t* values, size_t size) : type(INT_Token), data(values), size(size) {}
+  Column(const bool* values, size_t size) : type(BOOL_Token), data(values), size(size) {}
+  Column(const std::string* values, size_t size) : type(STR_Token), data(values), size(size) {}
+  Column(const std::vector<double>& values) : Column(values.data(), values.size()) {}
+  Column(const std::vector<int64_t>& values) : Column(values.data(), values.size()) {}
+  Column(const std::vector<std::string>& values) : Column(values.data(), values.size()) {}
+
+  packToken at(size_t row) const;
+};
+
+typedef std::map<std::string, Column> ColumnMap_t;
+
+#pragma endregion
+
 class calculator {
  public:
   static Config_t& Default();
@@ -741,8 +1839,13 @@ class calculator {
   static typeMap_t& type_attribute_map();
 
  public:
+  // If `cached` is true, expressions without a delimiter are compiled
+  // once, on an empty scope, and kept on cache(). See ProgramCache:
   static packToken calculate(const char* expr, const TokenMap &vars = TokenMap::empty,
-                             const char* delim = 0, const char** rest = 0);
+                             const char* delim = 0, const char** rest = 0,
+                             bool cached = false);
+
+  static ProgramCache& cache();
 
  public:
   static TokenBase* calculate(const TokenQueue_t& RPN, const TokenMap &scope,
@@ -751,6 +1854,30 @@ class calculator {
                             const char* delim = 0, const char** rest = 0,
                             const Config_t &config = Default());
 
+  // Replace the constant sub-expressions of an RPN by their values.
+  // Only operations marked as Operation::PURE and calls to pure
+  // functions are evaluated, and only results that are not containers
+  // are folded. Functions read from variables are only trusted if
+  // `vars`, the scope the RPN was built with, finds them on
+  // TokenMap::default_global(), so shadowing a pure builtin on the
+  // evaluation scope does not change the calls folded with it.
+  static void fold(TokenQueue_t* rpn, const Config_t &config = Default(),
+                   const TokenMap& vars = TokenMap::empty);
+
+  // Eliminate common sub-expressions: repeated sub-trees that have no
+  // side effects, i.e. only use PURE operations and pure functions,
+  // are computed once and then reused through TokenSlot tokens.
+  static void cse(TokenQueue_t* rpn, const Config_t &config = Default());
+
+ public:
+  // The evaluation engines eval() can use:
+  enum engine_t {
+    // Interpret the compiled Program:
+    INTERPRETER,
+    // Evaluate a ClosureProgram compiled from it:
+    CLOSURES
+  };
+
  public:
   // Used to dealloc a TokenQueue_t safely.
   struct RAII_TokenQueue_t;
@@ -758,58 +1885,287 @@ class calculator {
  protected:
   virtual const Config_t& Config() const { return Default(); }
 
+ public:
+  // A compiled expression. It is never modified after it is built,
+  // so it is shared by the copies of a calculator and may be
+  // evaluated by several threads at once. Recompiling, binding or
+  // changing the engine of a calculator builds a new one.
+  //
+  // The RPN is discarded once the Program is built, so the
+  // expression is kept only as contiguous instructions
+  // plus their constant and name tables.
+  struct Compiled {
+    Program program;
+    // Only built for the CLOSURES engine:
+    ClosureProgram closures;
+    Schema schema;
+
+    Compiled() {}
+    Compiled(const Compiled&) = delete;
+    Compiled& operator=(const Compiled&) = delete;
+  };
+
  private:
-  TokenQueue_t RPN;
+  std::shared_ptr<const Compiled> compiled;
+  engine_t engine = INTERPRETER;
+
+  static std::shared_ptr<const Compiled> assemble(Program program, const Schema& schema,
+                                                  engine_t engine, const Config_t& config);
+  // The expression `None`, shared by the calculators built empty:
+  static const std::shared_ptr<const Compiled>& none();
+  void rebuild(const Schema& schema, engine_t engine);
+
+  packToken eval_args(const packToken* args, const TokenMap &vars,
+                      bool keep_refs, Arena* arena) const;
 
  public:
   virtual ~calculator();
-  calculator() { this->RPN.push(new TokenNone()); }
+  calculator() : compiled(none()) {}
+
+  // Copies share the compiled expression, so they cost O(1):
   calculator(const calculator& calc);
+  calculator(calculator&& calc);
   calculator(const char* expr, TokenMap vars = &TokenMap::empty,
              const char* delim = 0, const char** rest = 0,
              const Config_t& config = Default());
   void compile(const char* expr, TokenMap &vars = TokenMap::empty,
                const char* delim = 0, const char** rest = 0);
-  packToken eval(const TokenMap &vars = TokenMap::empty, bool keep_refs = false) const;
+  packToken eval(const TokenMap &vars = TokenMap::empty, bool keep_refs = false,
+                 Arena* arena = 0) const;
+
+  // Bind the variables of the expression that are on `schema` to its
+  // slots, so they can be passed by position to the eval() below
+  // instead of being looked up by name. The binding is kept when
+  // the calculator is compiled again.
+  void bind(const Schema& schema);
+  const Schema& get_schema() const { return compiled->schema; }
+
+  // Evaluate it reading the bound variables from `args`, indexed by
+  // slot, and the other ones from `vars`. Fails if `args` is smaller
+  // than the schema:
+  packToken eval(const std::vector<packToken>& args,
+                 const TokenMap &vars = TokenMap::empty, bool keep_refs = false,
+                 Arena* arena = 0) const;
+
+  // Evaluate it once for each of the first `rows` rows of `columns`.
+  // Each row is evaluated on a child scope of `vars` where the
+  // columns are bound to their values on that row:
+  std::vector<packToken> eval_batch(const ColumnMap_t& columns, size_t rows,
+                                    const TokenMap& vars = TokenMap::empty) const;
+
+  // Returns all the variables of the expression, including the ones
+  // bound to slots. The slot layout is reported by get_schema():
   std::unordered_set<std::string> get_variables() const;
+  const Program& get_program() const { return compiled->program; }
+
+  // Select the engine used by eval(), e.g. CLOSURES
+  // for expressions that are evaluated many times:
+  void set_engine(engine_t engine);
+  engine_t get_engine() const { return engine; }
 
   // Serialization:
   std::string str() const;
-  static std::string str(TokenQueue_t rpn);
+  static std::string str(const TokenQueue_t& rpn);
+
+  // Save the compiled expression, with its schema and engine, on a
+  // versioned binary format. Returns "" if one of its constants
+  // can't be saved, e.g. a pointer or a function without a name:
+  std::string save() const;
+
+  // Load an expression saved by save(), e.g. from a memory mapped file.
+  // The functions it references are looked up by name on `vars`.
+  // Fails if the data is malformed, if its format version is unknown
+  // or if it applies operators that don't exist on Config():
+  bool load(const char* data, size_t size, const TokenMap& vars = TokenMap::empty);
+  bool load(const std::string& data, const TokenMap& vars = TokenMap::empty) {
+    return load(data.data(), data.size(), vars);
+  }
+
+  static const uint32_t FORMAT_VERSION = 1;
+
+  // Identifies the operations of a config. Expressions saved with the
+  // same fingerprint are loaded without checking their operators:
+  static uint64_t fingerprint(const Config_t& config);
 
   // Operators:
   calculator& operator=(const calculator& calc);
+  calculator& operator=(calculator&& calc);
 };
 
 #pragma region Function
 #include <list>
 #include <string>
 #include<functional>
+#include <type_traits>
   typedef std::list<std::string> args_t;
   class packToken;
+  class Function;
+
+  // The arguments of one Function call.
+  //
+  // The positional arguments are read in place, in the order of
+  // Function::args(), and the local scope where they are bound by
+  // name is only built if the function asks for it with scope().
+  class Frame {
+    const Function* func;
+    const packToken* _this;
+    const packToken* argv;
+    size_t argc;
+    TokenMap& parent;
+    std::unique_ptr<TokenMap> local;
+    // Where the local scope is allocated, if not on the heap:
+    Arena* arena;
+
+  public:
+    // If `_this` is null the caller scope is used as `this`:
+    Frame(const Function* func, const packToken* _this,
+          const packToken* argv, size_t argc, TokenMap& parent, Arena* arena = 0)
+      : func(func), _this(_this), argv(argv), argc(argc), parent(parent), arena(arena) {}
+    Frame(const Frame&) = delete;
+    Frame& operator=(const Frame&) = delete;
+
+    size_t size() const { return argc; }
+
+    // Returns None for the missing arguments:
+    const packToken& operator[](size_t i) const {
+      return i < argc ? argv[i] : packToken::None();
+    }
+
+    packToken self() const { return _this ? *_this : packToken(parent); }
+
+    // A child of the caller scope with the arguments and `this`:
+    TokenMap& scope();
+  };
 
   class Function : public TokenBase {
   public:
     static packToken call(packToken _this, const Function* func,
                           TokenList* args, TokenMap &scope);
+
+    // Same as above, reading the arguments in place.
+    // If `_this` is null the caller scope is used.
+    // The local scope is allocated from `arena` if provided:
+    static packToken call(const packToken* _this, const Function* func,
+                          const packToken* argv, size_t argc, TokenMap &scope,
+                          Arena* arena = 0);
   public:
     Function() : TokenBase(FUNC_Token) {}
     virtual ~Function() {}
 
   public:
     virtual const std::string name() const = 0;
-    virtual const args_t args() const = 0;
+    virtual const args_t& args() const = 0;
     virtual packToken exec(TokenMap &scope) const = 0;
     virtual TokenBase* clone() const = 0;
+
+    // Functions that can read their arguments by position
+    // should override it to avoid building the local scope:
+    virtual packToken exec(Frame& frame) const { return exec(frame.scope()); }
+
+    // Pure functions have no side effects and their result depends only
+    // on their arguments, so they may be evaluated at compile time:
+    virtual bool pure() const { return false; }
   };
 
+  // Conversions used by CppFunction::typed() to read the arguments
+  // and pack the result of C++ functions with typed parameters:
+  template <typename T, typename Enable = void>
+  struct argCast_t {
+    // Specialize packToken::as<T>() to support other types:
+    static T& get(const packToken& t) { return t.as<T>(); }
+  };
+  template <>
+  struct argCast_t<bool> {
+    static bool get(const packToken& t) { return t.asBool(); }
+  };
+  template <typename T>
+  struct argCast_t<T, typename std::enable_if<std::is_integral<T>::value>::type> {
+    static T get(const packToken& t) { return static_cast<T>(t.asInt()); }
+  };
+  template <typename T>
+  struct argCast_t<T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+    static T get(const packToken& t) { return static_cast<T>(t.asDouble()); }
+  };
+  template <>
+  struct argCast_t<std::string> {
+    static const std::string& get(const packToken& t) { return t.asString(); }
+  };
+  template <>
+  struct argCast_t<packToken> {
+    static const packToken& get(const packToken& t) { return t; }
+  };
+  template <>
+  struct argCast_t<TokenMap> {
+    static TokenMap& get(const packToken& t) { return t.asMap(); }
+  };
+  template <>
+  struct argCast_t<TokenList> {
+    static TokenList& get(const packToken& t) { return t.asList(); }
+  };
+
+  template <typename R, typename Enable = void>
+  struct resultCast_t {
+    static packToken pack(const R& r) { return packToken(r); }
+  };
+  template <typename R>
+  struct resultCast_t<R, typename std::enable_if<std::is_integral<R>::value &&
+                                                 !std::is_same<R, bool>::value>::type> {
+    static packToken pack(R r) { return static_cast<int64_t>(r); }
+  };
+  template <typename R>
+  struct resultCast_t<R, typename std::enable_if<std::is_floating_point<R>::value>::type> {
+    static packToken pack(R r) { return static_cast<double>(r); }
+  };
+
+  template <size_t... I>
+  struct indexList_t {};
+  template <size_t N, size_t... I>
+  struct makeIndexList_t : makeIndexList_t<N-1, N-1, I...> {};
+  template <size_t... I>
+  struct makeIndexList_t<0, I...> { typedef indexList_t<I...> type; };
+
+  // The signature of a C++ callable: a function
+  // pointer or a class with a single operator():
+  template <typename F>
+  struct signature_t : signature_t<decltype(&F::operator())> {};
+  template <typename R, typename... Args>
+  struct signature_t<R (*)(Args...)> {
+    static const size_t arity = sizeof...(Args);
+    typedef typename makeIndexList_t<sizeof...(Args)>::type indexes;
+
+    template <typename F, size_t... I>
+    static packToken call(const F& func, Frame& frame, indexList_t<I...>, std::false_type) {
+      return resultCast_t<typename std::decay<R>::type>::pack(
+          func(argCast_t<typename std::decay<Args>::type>::get(frame[I])...));
+    }
+
+    // Functions returning void return None:
+    template <typename F, size_t... I>
+    static packToken call(const F& func, Frame& frame, indexList_t<I...>, std::true_type) {
+      func(argCast_t<typename std::decay<Args>::type>::get(frame[I])...);
+      return packToken::None();
+    }
+
+    template <typename F>
+    static packToken call(const F& func, Frame& frame) {
+      return call(func, frame, indexes(), std::is_void<R>());
+    }
+  };
+  template <typename R, typename C, typename... Args>
+  struct signature_t<R (C::*)(Args...) const> : signature_t<R (*)(Args...)> {};
+  template <typename R, typename C, typename... Args>
+  struct signature_t<R (C::*)(Args...)> : signature_t<R (*)(Args...)> {};
+
   class CppFunction : public Function {
   public:
     packToken (*func)(TokenMap);
     std::function<packToken(TokenMap)> stdFunc;
+    // Native functions that read their arguments from the Frame:
+    std::function<packToken(Frame&)> frameFunc;
     args_t _args;
     std::string _name;
     bool isStdFunc;
+    bool isPure = false;
 
     CppFunction();
     CppFunction(packToken (*func)(TokenMap), const args_t args,
@@ -824,10 +2180,35 @@ class calculator {
     CppFunction(std::function<packToken(TokenMap)> func, unsigned int nargs,
                 const char** args, std::string name = "");
     CppFunction(std::function<packToken(TokenMap)> func, std::string name = "");
+    CppFunction(packToken (*func)(Frame&), const args_t args,
+                std::string name = "");
+
+    // Wrap a C++ function or lambda with typed parameters,
+    // e.g. `double(double, double)`, so it is called directly
+    // with the arguments converted by argCast_t.
+    // The parameters missing on `args` are named "arg<N>":
+    template <typename F>
+    static CppFunction typed(F func, args_t args = args_t(), std::string name = "") {
+      typedef signature_t<typename std::decay<F>::type> sig;
+      while (args.size() < sig::arity) {
+        args.push_back("arg" + std::to_string(args.size()));
+      }
+
+      CppFunction function;
+      function.frameFunc = [func](Frame& frame) { return sig::call(func, frame); };
+      function._args = args;
+      function._name = name;
+      return function;
+    }
 
     virtual const std::string name() const { return _name; }
-    virtual const args_t args() const { return _args; }
-    virtual packToken exec(TokenMap &scope) const { return isStdFunc ? stdFunc(scope) : func(scope); }
+    virtual const args_t& args() const { return _args; }
+    virtual packToken exec(TokenMap &scope) const;
+    virtual packToken exec(Frame& frame) const {
+      if (frameFunc) return frameFunc(frame);
+      return exec(frame.scope());
+    }
+    virtual bool pure() const { return isPure; }
 
     virtual TokenBase* clone() const {
       return new CppFunction(static_cast<const CppFunction&>(*this));
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <cstring>
 #include <memory>
 #include <string>
 #include "catch.hpp"
@@ -35,6 +36,15 @@ using cparse::rpnBuilder;
 using cparse::OppMap_t;
 using cparse::opMap_t;
 using cparse::parserMap_t;
+using cparse::Program;
+using cparse::opDispatch_t;
+using cparse::opSymbol_t;
+using cparse::opSymbols;
+using cparse::TokenBase;
+using cparse::Column;
+using cparse::ColumnMap_t;
+using cparse::INT_Token;
+using cparse::REAL_Token;
 
 TokenMap vars, emap, tmap, key3;
 
@@ -1180,3 +1190,1125 @@ TEST_CASE("Get variables") {
   auto expectedVars = std::unordered_set<std::string>{"a", "b", "c", "d"};
   REQUIRE(c.get_variables() == expectedVars);
 }
+
+TEST_CASE("Compiled programs", "[program]") {
+  TokenMap vars;
+  vars["a"] = 2;
+  vars["b"] = 3;
+
+  // Compile it on an empty scope so `a` and `b` stay as variables:
+  calculator c1("a + a * a - b", TokenMap());
+  const Program& p1 = c1.get_program();
+  REQUIRE(p1.code.size() == 7);
+  REQUIRE(p1.names.size() == 2);
+  REQUIRE(p1.code.back().arg == opSymbols::intern("-"));
+  REQUIRE(p1.depth == 3);
+
+  // Evaluating it several times should not change the program:
+  REQUIRE(c1.eval(vars).asDouble() == 3);
+  REQUIRE(c1.eval(vars).asDouble() == 3);
+  vars["b"] = 1;
+  REQUIRE(c1.eval(vars).asDouble() == 5);
+  REQUIRE(p1.code.size() == 7);
+
+  // It should give the same results, and leave the scope in the same
+  // state, as the RPN interpreter it replaced:
+  const char* cases[][3] = {
+    {"1 + 2 * 3", "7", "{ \"a\": 2, \"b\": 3 }"},
+    {"'str' + 10", "\"str10\"", "{ \"a\": 2, \"b\": 3 }"},
+    {"(1, 2, 3)", "(1, 2, 3)", "{ \"a\": 2, \"b\": 3 }"},
+    {"a = 10", "10", "{ \"a\": 10, \"b\": 3 }"},
+    {"abs(-a)", "2", "{ \"a\": 2, \"b\": 3 }"},
+    {"b = a * 3 + 1", "7", "{ \"a\": 2, \"b\": 7 }"},
+    {"!(a > b)", "True", "{ \"a\": 2, \"b\": 3 }"},
+  };
+  for (const auto& test : cases) {
+    GlobalScope scope;
+    scope["a"] = 2;
+    scope["b"] = 3;
+    calculator c2(test[0]);
+    REQUIRE(c2.eval(scope).str() == test[1]);
+    REQUIRE(packToken(scope).str() == test[2]);
+  }
+}
+
+TEST_CASE("Operation dispatch table", "[operation][dispatch]") {
+  opMap_t opMap;
+  REQUIRE(opMap.dispatch().find(0, INT_Token, INT_Token) == nullptr);
+
+  // Operators without operations of their own use the ANY_OP table:
+  opSymbol_t minus = opSymbols::intern("-");
+  opMap.add({NUM_Token, ANY_OP, NUM_Token}, &op3);
+  REQUIRE(opMap.dispatch().find(minus, INT_Token, REAL_Token) == &op3);
+  REQUIRE(opMap.dispatch().find(0, INT_Token, REAL_Token) == &op3);
+  REQUIRE(opMap.dispatch().find(0, STR_Token, INT_Token) == nullptr);
+
+  // The table should be rebuilt after each add():
+  opMap.add({NUM_Token, "-", NUM_Token}, &op4);
+  REQUIRE(opMap.dispatch().find(minus, INT_Token, BOOL_Token) == &op4);
+  REQUIRE(opMap.dispatch().find(minus, STR_Token, INT_Token) == nullptr);
+
+  opMap.add({STR_Token, ANY_OP, ANY_TYPE_Token}, &op1);
+  REQUIRE(opMap.dispatch().find(minus, STR_Token, INT_Token) == &op1);
+
+  // Kernels replace a generic operation for a single operator:
+  opMap.addKernel(&op3, "/", &slash_op);
+  REQUIRE(opMap.dispatch().find(opSymbols::intern("/"), INT_Token, INT_Token) == &slash_op);
+  REQUIRE(opMap.dispatch().find(0, INT_Token, INT_Token) == &op3);
+
+  // So do changes made directly on the map:
+  opSymbol_t times = opSymbols::intern("*");
+  uint64_t generation = opMap.generation();
+  opMap["*"].push_back(Operation({STR_Token, "*", STR_Token}, &op4));
+  REQUIRE(opMap.generation() != generation);
+  REQUIRE(opMap.dispatch().find(times, STR_Token, STR_Token) == &op4);
+  opMap.erase("*");
+  REQUIRE(opMap.dispatch().find(times, STR_Token, STR_Token) == &op1);
+
+  // The builtin numeral operations should not compare strings:
+  calculator c1("a + 2 * a", TokenMap());
+  TokenMap vars;
+  vars["a"] = 3;
+  REQUIRE(c1.eval(vars).asDouble() == 9);
+  REQUIRE(c1.eval(vars)->type == REAL_Token);
+}
+
+TEST_CASE("Interned operators", "[operation][parser]") {
+  REQUIRE(opSymbols::intern(ANY_OP) == 0);
+  REQUIRE(opSymbols::intern("+") == opSymbols::intern("+"));
+  REQUIRE(opSymbols::intern("+") != opSymbols::intern("-"));
+  REQUIRE(opSymbols::name(opSymbols::intern("+")) == "+");
+  REQUIRE(opSymbols::normalize(opSymbols::intern("L-")) == opSymbols::intern("-"));
+  REQUIRE(opSymbols::normalize(opSymbols::intern("-")) == opSymbols::intern("-"));
+
+  OppMap_t opp;
+  REQUIRE(opp.exists("()"));
+  REQUIRE(opp.exists("~") == false);
+  REQUIRE(opp.assoc("="));
+
+  opp.addUnary("~", 3);
+  opp.addRightUnary("!!", 2);
+  REQUIRE(opp.exists("~"));
+  REQUIRE(opp.prec(opp.id("~")) == 3);
+  REQUIRE(opp.leftUnary(opp.id("~")) == opp.id("L~"));
+  REQUIRE(opp.rightUnary(opp.id("~")) == 0);
+  REQUIRE(opp.rightUnary(opp.id("!!")) == opp.id("R!!"));
+  REQUIRE(opp.id("unknown") == 0);
+
+  // The RPN should hold the binary version of each operator:
+  TokenMap vars;
+  vars["x"] = 2;
+  calculator c1("1 - -x * 3", TokenMap());
+  REQUIRE(c1.str() == "calculator { RPN: [ 1, UnaryToken, x, -, 3, *, - ] }");
+  REQUIRE(c1.eval(vars).asInt() == 7);
+}
+
+TEST_CASE("Batch evaluation", "[batch]") {
+  const size_t rows = 2500;
+  std::vector<double> a;
+  std::vector<int64_t> b;
+  std::vector<std::string> s;
+  bool flags[rows];
+  for (size_t i = 0; i < rows; ++i) {
+    a.push_back(i * 0.5 - 100);
+    b.push_back(i % 7);
+    s.push_back(i % 2 ? "odd" : "even");
+    flags[i] = i % 3;
+  }
+
+  ColumnMap_t columns;
+  columns["a"] = Column(a);
+  columns["b"] = Column(b);
+  columns["s"] = Column(s);
+  columns["flag"] = Column(flags, rows);
+
+  // It should produce the same results as evaluating each row:
+  const char* exprs[] = {
+    "a * 2 + b", "a > b * 10", "-a / (b + 1) ** 2", "flag + 1 <= b",
+    "s + (a - b)", "abs(a * b) + 1", "a", "b << 2", "x = 1, x + a", "c + a * b"
+  };
+  for (const char* expr : exprs) {
+    GlobalScope vars;
+    calculator c1(expr, TokenMap());
+    std::vector<packToken> results = c1.eval_batch(columns, rows, vars);
+    REQUIRE(results.size() == rows);
+
+    size_t mismatches = 0;
+    for (size_t i = 0; i < rows; ++i) {
+      TokenMap row = vars.getChild();
+      row["a"] = a[i];
+      row["b"] = b[i];
+      row["s"] = s[i];
+      row["flag"] = flags[i];
+      if (results[i].str() != c1.eval(row).str() ||
+          results[i]->type != c1.eval(row)->type) {
+        ++mismatches;
+      }
+    }
+    REQUIRE(mismatches == 0);
+  }
+
+  // The values expected for the row 3, where a = -98.5, b = 3, s = "odd" and flag = 0:
+  const char* cases[][2] = {
+    {"a * 2 + b", "-194"}, {"a > b * 10", "False"}, {"flag + 1 <= b", "True"},
+    {"s + (a - b)", "\"odd-101.5\""}, {"b << 2", "12"}, {"x = 1, x + a", "(1, -97.5)"},
+  };
+  for (const auto& test : cases) {
+    REQUIRE(calculator(test[0], TokenMap()).eval_batch(columns, 4)[3].str() == test[1]);
+  }
+  REQUIRE(calculator("a * 2", TokenMap()).eval_batch(columns, 3)[2].asDouble() == -198);
+  REQUIRE(calculator("a < 0", TokenMap()).eval_batch(columns, 3)[0]->type == BOOL_Token);
+
+  // Columns shorter than the batch are rejected:
+  REQUIRE(calculator("a", TokenMap()).eval_batch(columns, rows + 1).size() == 0);
+}
+
+TEST_CASE("Unboxed numeric evaluation", "[program]") {
+  REQUIRE(calculator("a * 2 + -b", TokenMap()).get_program().numeric);
+  REQUIRE(calculator("a > 1.5 == (b < 3)", TokenMap()).get_program().numeric);
+  REQUIRE(calculator("a", TokenMap()).get_program().numeric == false);
+  REQUIRE(calculator("'s' + a", TokenMap()).get_program().numeric == false);
+  REQUIRE(calculator("abs(a) + 1", TokenMap()).get_program().numeric == false);
+
+  // It should produce the same results as the generic evaluation,
+  // falling back to it whenever a value or operation is not numeric.
+  // The expected values are the ones of each set of `values`:
+  const char* cases[][4] = {
+    {"a * 2 + -b", "3.5", "13.5", "False"},
+    {"a / b ** 2 - 1", "-0.52", "6.25", "\"\""},
+    {"a > 1.5", "True", "True", "True"},
+    {"a <= b", "False", "False", "\"\""},
+    {"(a > 1) + 1", "2", "2", "2"},
+    {"a << 2", "12", "28", "16"},
+    {"a % b + 1", "2", "1", "\"1\""},
+    {"-a - 1", "-4", "-8.25", "-5"},
+    {"+a * 1", "3", "7.25", "4"},
+    {"a + c", "False", "False", "False"},
+  };
+  TokenMap values[3];
+  values[0]["a"] = 3; values[0]["b"] = 2.5;
+  values[1]["a"] = 7.25; values[1]["b"] = true;
+  values[2]["a"] = 4; values[2]["b"] = "str";
+
+  for (const auto& test : cases) {
+    calculator c1(test[0], TokenMap());
+    for (int i = 0; i < 3; ++i) {
+      REQUIRE(c1.eval(values[i]).str() == test[i + 1]);
+    }
+  }
+
+  // The unboxed results keep the types of the generic evaluation:
+  REQUIRE(calculator("a << 2", TokenMap()).eval(values[0])->type == INT_Token);
+  REQUIRE(calculator("(a > 1) + 1", TokenMap()).eval(values[0])->type == REAL_Token);
+  REQUIRE(calculator("a <= b", TokenMap()).eval(values[0])->type == BOOL_Token);
+
+  // Compile-time references are also resolved on the evaluation scope:
+  TokenMap vars;
+  vars["a"] = 10;
+  calculator c2("a * 2", vars);
+  REQUIRE(c2.get_program().numeric);
+  REQUIRE(c2.eval(TokenMap()).asDouble() == 20);
+  vars["a"] = 2;
+  REQUIRE(c2.eval(vars).asDouble() == 4);
+}
+
+TEST_CASE("Constant folding", "[fold]") {
+  TokenMap vars;
+  vars["x"] = 2;
+
+  calculator c1("x * (60 * 60 * 24)", TokenMap());
+  REQUIRE(c1.str() == "calculator { RPN: [ x, 86400, * ] }");
+  REQUIRE(c1.eval(vars).asDouble() == 172800);
+
+  calculator c2("2 ** 10 + x", TokenMap());
+  REQUIRE(c2.str() == "calculator { RPN: [ 1024, x, + ] }");
+  REQUIRE(c2.eval(vars).asDouble() == 1026);
+
+  // Pure builtin functions are folded when their arguments are constant:
+  GlobalScope global;
+  calculator c3("abs(-3) + pow(2, 3) + x", global);
+  REQUIRE(c3.str() == "calculator { RPN: [ 11, x, + ] }");
+  REQUIRE(c3.eval(vars).asDouble() == 13);
+
+  // Other functions are read from the scope on each evaluation:
+  CppFunction hundred = CppFunction::typed([](double x) { return x * 100; });
+  hundred.isPure = true;
+  TokenMap local(&global);
+  local["abs"] = hundred;
+  local["x"] = 2;
+  calculator c9("abs(-3) + x", local);
+  REQUIRE(c9.eval(local).asDouble() == -298);
+
+  TokenMap shadow(&global);
+  shadow["x"] = 2;
+  shadow["abs"] = CppFunction::typed([](double x) { return x * 10; });
+  REQUIRE(c9.eval(shadow).asDouble() == -28);
+  REQUIRE(c3.eval(shadow).asDouble() == 13);
+
+  calculator c4("'a' + 'b' == 'ab' && 1 < 2", TokenMap());
+  REQUIRE(c4.str() == "calculator { RPN: [ True ] }");
+
+  // Impure operations and functions are kept:
+  calculator c5("print(1 + 1)", global);
+  REQUIRE(c5.get_program().code.size() == 3);
+  calculator c6("y = 2 * 3", TokenMap());
+  REQUIRE(c6.str() == "calculator { RPN: [ y, 6, = ] }");
+
+  // Containers are never folded:
+  calculator c7("(1, 2 + 3)", TokenMap());
+  REQUIRE(c7.str() == "calculator { RPN: [ 1, 5, , ] }");
+  REQUIRE(c7.eval().str() == "(1, 5)");
+  REQUIRE(c7.eval().str() == "(1, 5)");
+
+  // Variables captured at compile time are not constants:
+  calculator c8("x * 2", vars);
+  REQUIRE(c8.get_program().constants.size() == 2);
+}
+
+TEST_CASE("Common subexpression elimination", "[cse]") {
+  TokenMap vars;
+  vars["price"] = 20;
+  vars["qty"] = 10;
+
+  const char* expr = "price * qty > 100 && price * qty < 1000";
+  calculator c1(expr, TokenMap());
+  REQUIRE(c1.str() == "calculator { RPN: [ price, qty, *, save #0, 100, >, "
+                      "load #0, 1000, <, && ] }");
+  REQUIRE(c1.eval(vars).asBool() == true);
+  vars["qty"] = 100;
+  REQUIRE(c1.eval(vars).asBool() == false);
+
+  // Numeric programs reuse the unboxed values:
+  calculator c2("(x + 1) * (x + 1)", TokenMap());
+  REQUIRE(c2.str() == "calculator { RPN: [ x, 1, +, save #0, load #0, * ] }");
+  REQUIRE(c2.get_program().numeric);
+  vars["x"] = 3;
+  REQUIRE(c2.eval(vars).asDouble() == 16);
+
+  std::vector<double> xs = {1, 2, 3};
+  ColumnMap_t columns;
+  columns["x"] = Column(xs);
+  std::vector<packToken> results = c2.eval_batch(columns, 3);
+  REQUIRE(results.size() == 3);
+  REQUIRE(results[2].asDouble() == 16);
+
+  // Side effects in between prevent the reuse:
+  const char* assign = "x * 2 + (x = 5) + x * 2";
+  calculator c3(assign, TokenMap());
+  REQUIRE(c3.str().find("load") == std::string::npos);
+  TokenMap scope1, scope2;
+  scope1["x"] = 1;
+  scope2["x"] = 1;
+  REQUIRE(c3.eval(scope1) == calculator::calculate(assign, scope2));
+  REQUIRE(c3.eval(scope1).asDouble() == 25);
+
+  // Calls through variables are never merged since the
+  // evaluation scope might shadow them with impure functions:
+  GlobalScope global;
+  int calls = 0;
+  TokenMap counted(&global);
+  counted["x"] = 3;
+  counted["abs"] = CppFunction::typed([&calls](int n) { ++calls; return n; });
+  calculator c4("abs(x - 1) + abs(x - 1)", global);
+  REQUIRE(c4.eval(counted).asInt() == 4);
+  REQUIRE(calls == 2);
+}
+
+TEST_CASE("Closure engine", "[closures]") {
+  GlobalScope global;
+  TokenMap vars(&global);
+  vars["x"] = 3;
+  vars["s"] = "abc";
+  vars["m"] = TokenMap();
+  vars["m"]["a"] = 10;
+
+  // Both engines give the expected results:
+  const char* cases[][2] = {
+    {"x * 2 + 1", "7"},
+    {"(x + 1) * (x + 1) > 10 && x < 5", "True"},
+    {"abs(x - 10) + pow(x, 2)", "16"},
+    {"s + 'd' == 'abcd'", "True"},
+    {"m['a'] * x", "30"},
+    {"m['a'] + 1", "11"},
+    {"(x, 2, 'y')", "(3, 2, \"y\")"},
+    {"y + 1", "False"},
+    {"'a' - 1", "\"\""},
+  };
+
+  for (const auto& test : cases) {
+    calculator c1(test[0], global);
+    calculator c2(test[0], global);
+    c2.set_engine(calculator::CLOSURES);
+    REQUIRE(c2.get_engine() == calculator::CLOSURES);
+    REQUIRE(c1.eval(vars).str() == test[1]);
+    REQUIRE(c2.eval(vars).str() == test[1]);
+
+    // Copies keep their own tree:
+    calculator c3(c2);
+    calculator c4;
+    c4 = c2;
+    REQUIRE(c3.eval(vars).str() == test[1]);
+    REQUIRE(c4.eval(vars).str() == test[1]);
+  }
+
+  // Assignments go through references exactly like the interpreter:
+  calculator c5("z = x * 2", global);
+  c5.set_engine(calculator::CLOSURES);
+  REQUIRE(c5.eval(vars).asDouble() == 6);
+  REQUIRE(vars["z"].asDouble() == 6);
+
+  // compile() rebuilds the tree:
+  c5.compile("x - 1", vars);
+  REQUIRE(c5.eval(vars).asDouble() == 2);
+  c5.set_engine(calculator::INTERPRETER);
+  REQUIRE(c5.eval(vars).asDouble() == 2);
+
+  // Operations bound at compile time are not used after the opMap changes:
+  myCalc c6;
+  c6.compile("x * 3", vars);
+  c6.set_engine(calculator::CLOSURES);
+  REQUIRE(c6.eval(vars).asDouble() == 9);
+  opMap_t& opMap = myCalc::my_config().opMap;
+  opMap["*"].front() = Operation({NUM_Token, "*", NUM_Token}, &op3);
+  REQUIRE(c6.eval(vars).asDouble() == 0);
+  opMap["*"].front() = Operation({NUM_Token, "*", NUM_Token}, &op4);
+  REQUIRE(c6.eval(vars).asDouble() == 9);
+}
+
+TEST_CASE("Inline scalar storage", "[packToken]") {
+  auto inside = [](const packToken& p) {
+    const char* begin = reinterpret_cast<const char*>(&p);
+    const char* token = reinterpret_cast<const char*>(p.token());
+    return token >= begin && token < begin + sizeof(packToken);
+  };
+
+  packToken none, real = 2.5, integer = 7, boolean = true;
+  REQUIRE(inside(none));
+  REQUIRE(inside(real));
+  REQUIRE(inside(integer));
+  REQUIRE(inside(boolean));
+  REQUIRE(none->type == NONE_Token);
+  REQUIRE(real->type == REAL_Token);
+  REQUIRE(integer->type == INT_Token);
+  REQUIRE(boolean->type == BOOL_Token);
+
+  // Copies are inline as well and do not share the value:
+  packToken copy = real;
+  REQUIRE(inside(copy));
+  copy = 3.5;
+  REQUIRE(real.asDouble() == 2.5);
+  REQUIRE(copy.asDouble() == 3.5);
+
+  packToken moved(std::move(copy));
+  REQUIRE(inside(moved));
+  REQUIRE(moved.asDouble() == 3.5);
+
+  // Other types stay on the heap:
+  packToken str = "text";
+  REQUIRE(!inside(str));
+  REQUIRE(!inside(packToken(TokenMap())));
+
+  // Released tokens are always owned by the caller:
+  TokenBase* base = packToken(integer).release();
+  REQUIRE(base->type == INT_Token);
+  REQUIRE(packToken(base).asInt() == 7);
+
+  // Assigning a value owned by the token itself:
+  packToken map = TokenMap();
+  map["key"] = 10;
+  map = map["key"];
+  REQUIRE(map.asInt() == 10);
+}
+
+TEST_CASE("Shared string payloads", "[packToken]") {
+  packToken a = std::string(1000, 'x');
+  packToken b = a;
+  const packToken& ca = a;
+  const packToken& cb = b;
+  REQUIRE(&ca.asString() == &cb.asString());
+
+  // Strings edited in place are copied first, so the other copies don't change:
+  b.asString() += "y";
+  REQUIRE(ca.asString().size() == 1000);
+  REQUIRE(cb.asString().size() == 1001);
+  REQUIRE(&ca.asString() != &cb.asString());
+
+  // Operators can still be read as strings:
+  packToken op(cparse::TokenOp(opSymbols::intern("+")));
+  REQUIRE(static_cast<const packToken&>(op).asString() == "+");
+  op.asString() += "+";
+  REQUIRE(static_cast<const packToken&>(op).asString() == "+");
+
+  // String constants are not copied when evaluated:
+  calculator c1("'a long string constant'", TokenMap());
+  const packToken r1 = c1.eval();
+  const packToken r2 = c1.eval();
+  REQUIRE(r1.asString() == "a long string constant");
+  REQUIRE(&r1.asString() == &r2.asString());
+}
+
+TEST_CASE("Evaluation arena", "[arena]") {
+  GlobalScope global;
+  TokenMap vars(&global);
+  vars["s"] = std::string(100, 'x');
+  vars["n"] = 4;
+  cparse::Arena arena;
+
+  calculator c1("s + 'y'", global);
+  calculator c2("t = s", global);
+  calculator c3("abs(n - 10) * 2", global);
+  calculator c4("s", global);
+  c4.set_engine(calculator::CLOSURES);
+
+  // Tuples and the local scopes of the calls are built on it as well:
+  vars["second"] = CppFunction(+[](TokenMap scope) { return scope["b"]; },
+                                {"a", "b"}, "second");
+  calculator c5("(n, second(1, (2, s)), 'z')", global);
+
+  packToken r1 = c1.eval(vars, false, &arena);
+  packToken r2 = c2.eval(vars, false, &arena);
+  packToken r3 = c3.eval(vars, false, &arena);
+  packToken r4 = c4.eval(vars, false, &arena);
+  packToken r5 = c4.eval(vars, true, &arena);
+  packToken r6 = c5.eval(vars, false, &arena);
+  arena.reset();
+
+  // Results and assigned values outlive the arena:
+  REQUIRE(r1.asString() == std::string(100, 'x') + "y");
+  REQUIRE(r2.asString() == std::string(100, 'x'));
+  REQUIRE(vars["t"].asString() == std::string(100, 'x'));
+  REQUIRE(r3.asDouble() == 12);
+  REQUIRE(r4.asString() == std::string(100, 'x'));
+  REQUIRE(r5->type == (STR_Token | REF_Token));
+  REQUIRE(r6->type == TUPLE_Token);
+  REQUIRE(r6.str() == "(4, (2, \"" + std::string(100, 'x') + "\"), \"z\")");
+
+  // The memory is reused after a reset:
+  for (int i = 0; i < 100; ++i) {
+    vars["n"] = i;
+    REQUIRE(c3.eval(vars, false, &arena).asDouble() == 2 * std::abs(i - 10));
+    arena.reset();
+  }
+}
+
+TEST_CASE("Reference elision", "[refs]") {
+  TokenMap vars;
+  vars["x"] = 2;
+  vars["y"] = 3;
+  vars["s"] = "text";
+
+  // Values used only by operations that do not read references are pushed as is:
+  calculator c1("x + y * 2", TokenMap());
+  for (const auto& inst : c1.get_program().code) {
+    if (inst.code == cparse::PUSH_VAR) REQUIRE(!inst.ref);
+  }
+  REQUIRE(c1.eval(vars).asDouble() == 8);
+
+  // Assignments still receive references:
+  calculator c2("z = y + 1", TokenMap());
+  const auto& code = c2.get_program().code;
+  REQUIRE(code[0].code == cparse::PUSH_VAR);
+  REQUIRE(code[0].ref);
+  REQUIRE(code[1].code == cparse::PUSH_VAR);
+  REQUIRE(!code[1].ref);
+  REQUIRE(c2.eval(vars).asDouble() == 4);
+  REQUIRE(vars["z"].asDouble() == 4);
+
+  // And so do the values returned by eval():
+  calculator c3("x", TokenMap());
+  REQUIRE(c3.eval(vars, true)->type == (REF_Token | cparse::INT_Token));
+
+  // Methods are called with their object:
+  GlobalScope global;
+  calculator c4("s.len() + x", global);
+  REQUIRE(c4.eval(vars).asInt() == 6);
+}
+
+TEST_CASE("Schema slot binding", "[schema]") {
+  cparse::Schema schema;
+  schema.add("x", cparse::REAL_Token).add("y");
+
+  calculator c1("x * 2 + y - z", TokenMap());
+  c1.bind(schema);
+  REQUIRE(c1.get_schema().find("y") == 1);
+  REQUIRE(c1.get_schema().find("z") == -1);
+  REQUIRE(c1.get_variables().size() == 3);
+
+  // Bound variables are read by position, the others by name:
+  TokenMap vars;
+  vars["z"] = 1;
+  std::vector<packToken> args = {3, 4};
+  REQUIRE(c1.eval(args, vars).asDouble() == 9);
+
+  // The TokenMap based eval() still works:
+  vars["x"] = 1;
+  vars["y"] = 2;
+  REQUIRE(c1.eval(vars).asDouble() == 3);
+
+  // Missing slots make it fail:
+  REQUIRE(c1.eval(std::vector<packToken>{3}, vars).asBool() == false);
+
+  // Both engines and non numeric values:
+  calculator c2("name + '!' == greeting", TokenMap());
+  c2.bind({"name", "greeting"});
+  args = {"hi", "hi!"};
+  REQUIRE(c2.eval(args).asBool() == true);
+  c2.set_engine(calculator::CLOSURES);
+  REQUIRE(c2.eval(args).asBool() == true);
+  args[1] = "hey!";
+  REQUIRE(c2.eval(args).asBool() == false);
+
+  // The binding is kept by copies and by new compilations:
+  calculator c3 = c1;
+  REQUIRE(c3.eval(std::vector<packToken>{5, 0}, vars).asDouble() == 9);
+  c3.compile("y - x");
+  REQUIRE(c3.eval(std::vector<packToken>{1, 4}).asDouble() == 3);
+}
+
+packToken frame_hypot(cparse::Frame& args) {
+  return std::sqrt(args[0].asDouble() * args[0].asDouble() +
+                   args[1].asDouble() * args[1].asDouble());
+}
+
+packToken frame_scope(cparse::Frame& args) {
+  // Functions may still ask for the local scope:
+  return args.scope()["a"].asDouble() + args.scope()["this"]["k"].asDouble();
+}
+
+TEST_CASE("Call frames", "[function]") {
+  GlobalScope global;
+  global["hypot"] = CppFunction(&frame_hypot, {"x", "y"}, "hypot");
+  global["f"] = CppFunction(&frame_scope, {"a"}, "f");
+
+  TokenMap vars(&global);
+  vars["k"] = 10;
+  REQUIRE(calculator::calculate("hypot(3, 4)", vars).asDouble() == 5);
+  REQUIRE(calculator::calculate("sqrt(16) + pow(2, 3) + abs(-1)", vars).asDouble() == 13);
+
+  // Missing arguments are None:
+  REQUIRE(calculator::calculate("hypot(3)", vars).asDouble() != 3);
+
+  // `this` is the caller scope or the object of a method:
+  REQUIRE(calculator::calculate("f(1)", vars).asDouble() == 11);
+  vars["obj"] = TokenMap();
+  vars["obj"]["k"] = 20;
+  vars["obj"]["f"] = global["f"];
+  REQUIRE(calculator::calculate("obj['f'](2)", vars).asDouble() == 22);
+
+  // Calling them with a TokenMap still works:
+  TokenMap scope;
+  scope["x"] = 6;
+  scope["y"] = 8;
+  REQUIRE(global["hypot"].asFunc()->exec(scope).asDouble() == 10);
+}
+
+double typed_clamp(double value, double low, double high) {
+  return value < low ? low : (value > high ? high : value);
+}
+
+TEST_CASE("Typed native functions", "[function]") {
+  GlobalScope global;
+  global["clamp"] = CppFunction::typed(&typed_clamp, {"value", "low", "high"}, "clamp");
+  global["repeat"] = CppFunction::typed(
+      [](const std::string& text, int64_t times) {
+        std::string result;
+        for (int64_t i = 0; i < times; ++i) result += text;
+        return result;
+      }, {}, "repeat");
+
+  int calls = 0;
+  global["count"] = CppFunction::typed([&calls](int n) { calls += n; });
+  global["half"] = CppFunction::typed([](int n) { return n / 2; });
+  global["isEmpty"] = CppFunction::typed([](const TokenMap& map) { return map.map().empty(); });
+
+  TokenMap vars(&global);
+  REQUIRE(calculator::calculate("clamp(15, 0, 10)", vars).asDouble() == 10);
+  REQUIRE(calculator::calculate("repeat('ab', 3)", vars).asString() == "ababab");
+  REQUIRE(calculator::calculate("half(7)", vars)->type == cparse::INT_Token);
+  REQUIRE(calculator::calculate("half(7)", vars).asInt() == 3);
+  vars["m"] = TokenMap();
+  REQUIRE(calculator::calculate("isEmpty(m)", vars).asBool() == true);
+
+  // Functions returning void return None:
+  REQUIRE(calculator::calculate("count(2)", vars)->type == NONE_Token);
+  REQUIRE(calculator::calculate("count(3)", vars)->type == NONE_Token);
+  REQUIRE(calls == 5);
+
+  // Unnamed parameters are named by position:
+  cparse::Function* repeat = global["repeat"].asFunc();
+  REQUIRE(repeat->args() == cparse::args_t({"arg0", "arg1"}));
+  TokenMap scope;
+  scope["arg0"] = "x";
+  scope["arg1"] = 2;
+  REQUIRE(repeat->exec(scope).asString() == "xx");
+}
+
+TEST_CASE("Move semantics", "[move]") {
+  TokenMap vars;
+  vars["x"] = 4;
+
+  // Moving a calculator takes its compiled program instead of copying it:
+  calculator c1("x * 2 + 1", TokenMap());
+  c1.set_engine(calculator::CLOSURES);
+  const cparse::Instruction* code = c1.get_program().code.data();
+
+  calculator c2(std::move(c1));
+  REQUIRE(c2.get_program().code.data() == code);
+  REQUIRE(c2.eval(vars).asDouble() == 9);
+
+  calculator c3;
+  c3 = std::move(c2);
+  REQUIRE(c3.get_program().code.data() == code);
+  REQUIRE(c3.eval(vars).asDouble() == 9);
+  REQUIRE(c3.str() == "calculator { RPN: [ x, 2, *, 1, + ] }");
+
+  // The moved-from calculators can still be reused:
+  c1.compile("x - 1");
+  REQUIRE(c1.eval(vars).asDouble() == 3);
+
+  std::vector<calculator> calcs;
+  calcs.push_back(calculator("x + 1", TokenMap()));
+  calcs.push_back(std::move(c3));
+  REQUIRE(calcs[0].eval(vars).asDouble() == 5);
+  REQUIRE(calcs[1].eval(vars).asDouble() == 9);
+
+  // Move assigning packTokens, even from a value they own:
+  TokenList list;
+  list.push(1);
+  list.push("two");
+  packToken p1 = list;
+  packToken p2;
+  p2 = std::move(p1);
+  REQUIRE(p2.asList().list().size() == 2);
+  REQUIRE(&p2.asList().list() == &list.list());
+
+  p2 = std::move(p2.asList()[1]);
+  REQUIRE(p2.asString() == "two");
+}
+
+TEST_CASE("Shared compiled expressions", "[calculator]") {
+  TokenMap vars;
+  vars["x"] = 3;
+
+  // Copies share the compiled expression:
+  calculator c1("x * x", TokenMap());
+  calculator c2 = c1;
+  calculator c3;
+  c3 = c2;
+  REQUIRE(&c2.get_program() == &c1.get_program());
+  REQUIRE(&c3.get_program() == &c1.get_program());
+
+  // Recompiling, binding or changing the engine of
+  // a copy does not affect the other ones:
+  c2.compile("x + 1");
+  REQUIRE(c1.eval(vars).asDouble() == 9);
+  REQUIRE(c2.eval(vars).asDouble() == 4);
+
+  c3.bind({"x"});
+  c3.set_engine(calculator::CLOSURES);
+  REQUIRE(&c3.get_program() != &c1.get_program());
+  REQUIRE(c3.eval(std::vector<packToken>{5}).asDouble() == 25);
+  REQUIRE(c1.get_schema().size() == 0);
+  REQUIRE(c1.get_engine() == calculator::INTERPRETER);
+  REQUIRE(c1.eval(vars).asDouble() == 9);
+
+  // The expression outlives the calculator it was compiled by:
+  calculator* c4 = new calculator("x - 1", TokenMap());
+  calculator c5 = *c4;
+  delete c4;
+  REQUIRE(c5.eval(vars).asDouble() == 2);
+
+  // Empty calculators share the same expression:
+  REQUIRE(&calculator().get_program() == &calculator().get_program());
+  REQUIRE(calculator().eval()->type == NONE_Token);
+}
+
+TEST_CASE("Compact compiled expressions", "[program]") {
+  TokenMap vars;
+  vars["a"] = 2;
+  vars["b"] = 5;
+
+  // Only the instructions and their tables are kept:
+  calculator c1("a * 3 + b * 2 - (a * 3)", TokenMap());
+  const cparse::Program& program = c1.get_program();
+  REQUIRE(program.code.size() == program.code.capacity());
+  REQUIRE(program.constants.size() == program.constants.capacity());
+  REQUIRE(c1.str() == "calculator { RPN: [ a, 3, *, save #0, b, 2, *, +, load #0, - ] }");
+  REQUIRE(c1.get_variables() == std::unordered_set<std::string>({"a", "b"}));
+  REQUIRE(c1.eval(vars).asDouble() == 10);
+
+  // Bindings can be replaced or undone:
+  c1.bind({"b"});
+  REQUIRE(c1.eval(std::vector<packToken>{1}, vars).asDouble() == 2);
+  c1.bind({"a", "b"});
+  REQUIRE(c1.eval(std::vector<packToken>{0, 3}).asDouble() == 6);
+  c1.bind(cparse::Schema());
+  REQUIRE(c1.eval(vars).asDouble() == 10);
+  REQUIRE(c1.get_variables() == std::unordered_set<std::string>({"a", "b"}));
+}
+
+TEST_CASE("Hashed map storage", "[map]") {
+  cparse::TokenMap_t map;
+  std::map<std::string, int64_t> expected;
+  std::vector<std::string> order;
+
+  // Grow it past the hash threshold while erasing some keys:
+  uint32_t seed = 42;
+  size_t erased = 0;
+  for (int i = 0; i < 2000; ++i) {
+    seed = seed * 1103515245 + 12345;
+    std::string key = "k" + std::to_string(seed % 500);
+    if (seed % 7 == 0) {
+      erased += map.erase(key);
+      expected.erase(key);
+      order.erase(std::remove(order.begin(), order.end(), key), order.end());
+    } else {
+      if (!expected.count(key)) order.push_back(key);
+      map[key] = static_cast<int64_t>(i);
+      expected[key] = i;
+    }
+  }
+
+  REQUIRE(erased > 0);
+  REQUIRE(map.size() == expected.size());
+  bool found = true;
+  for (const auto& pair : expected) {
+    auto it = map.find(pair.first);
+    found = found && it != map.end() && it->second.asInt() == pair.second;
+  }
+  REQUIRE(found);
+  REQUIRE(map.count("missing") == 0);
+
+  // It is iterated in insertion order:
+  std::vector<std::string> keys;
+  for (const auto& entry : map) keys.push_back(entry.first);
+  REQUIRE(keys == order);
+
+  // Inserting keys does not move the other values:
+  packToken* first = &map[order[0]];
+  for (int i = 0; i < 1000; ++i) map["new" + std::to_string(i)] = i;
+  REQUIRE(first == &map[order[0]]);
+
+  // Small maps keep their entries inline and can be reused after clear():
+  cparse::TokenMap_t small;
+  small["a"] = 1;
+  small["b"] = "x";
+  small.clear();
+  REQUIRE(small.empty());
+  small["c"] = 3;
+  const std::string& name = small.begin()->first;
+  REQUIRE(name == "c");
+  REQUIRE(small.size() == 1);
+  REQUIRE(small.count("a") == 0);
+
+  // Erasing is O(1) amortized and keeps the order of the other keys:
+  cparse::TokenMap_t big;
+  for (int i = 0; i < 100000; ++i) big["b" + std::to_string(i)] = i;
+  for (int i = 0; i < 100000; i += 2) big.erase("b" + std::to_string(i));
+  REQUIRE(big.size() == 50000);
+  REQUIRE(big.begin()->second.asInt() == 1);
+  bool ordered = true;
+  int64_t last = -1;
+  for (const auto& entry : big) {
+    ordered = ordered && entry.second.asInt() == last + 2;
+    last = entry.second.asInt();
+  }
+  REQUIRE(ordered);
+  REQUIRE(big.count("b99999") == 1);
+  REQUIRE(big.count("b99998") == 0);
+
+  size_t visited = 0;
+  for (auto it = big.begin(); it != big.end(); ++visited) {
+    if (visited % 3 == 0) {
+      it = big.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  REQUIRE(visited == 50000);
+  REQUIRE(big.size() == 50000 - 16667);
+  while (!big.empty()) big.erase(big.begin());
+  REQUIRE(big.begin() == big.end());
+
+  // TokenMaps keep working on top of it:
+  TokenMap vars;
+  for (int i = 0; i < 20; ++i) vars["v" + std::to_string(i)] = i;
+  vars.erase("v3");
+  REQUIRE(calculator::calculate("v19 + v10 + v2", vars).asInt() == 31);
+  REQUIRE(vars.find("v3") == 0);
+  REQUIRE(vars.map().size() == 19);
+}
+
+TEST_CASE("Interned symbols", "[map]") {
+  using cparse::Symbol;
+
+  // The same name is always interned as the same Symbol:
+  Symbol a("interned_key"), b(std::string("interned_") + "key");
+  REQUIRE(a == b);
+  REQUIRE(&a.str() == &b.str());
+  REQUIRE(a == "interned_key");
+  REQUIRE(a != Symbol("other_key"));
+
+  // Looking up a name does not intern it:
+  size_t count = Symbol::count();
+  REQUIRE(Symbol::find("never_interned_key").null());
+  REQUIRE(Symbol::count() == count);
+  REQUIRE(Symbol::find("interned_key") == a);
+
+  // Maps can be accessed by Symbol or by string:
+  TokenMap vars;
+  vars[a] = 10;
+  vars["interned_other"] = 20;
+  REQUIRE(vars["interned_key"].asInt() == 10);
+  REQUIRE(vars.find(Symbol("interned_other"))->asInt() == 20);
+  REQUIRE(vars.find(Symbol()) == 0);
+  REQUIRE(vars.find("never_interned_key") == 0);
+  REQUIRE(Symbol::find("never_interned_key").null());
+
+  // Compiled expressions refer to their variables by Symbol:
+  calculator c("interned_key * 2 + interned_other");
+  REQUIRE(c.eval(vars).asInt() == 40);
+  REQUIRE(c.get_program().names[0] == a);
+
+  // Names are released with their last Symbol, and the
+  // identifiers the parser doesn't find are not interned:
+  count = Symbol::count();
+  {
+    TokenMap scope;
+    scope["released_key"] = 1;
+    REQUIRE(Symbol::count() == count + 1);
+    calculator c2("released_key + unknown_name", scope);
+    REQUIRE(Symbol::count() == count + 2);
+    REQUIRE(Symbol::find("unknown_name") == c2.get_program().names[0]);
+  }
+  REQUIRE(Symbol::count() == count);
+  REQUIRE(Symbol::find("released_key").null());
+  REQUIRE(Symbol::find("unknown_name").null());
+
+  cparse::TokenQueue_t rpn = calculator::toRPN("never_stored + 1", vars);
+  REQUIRE(Symbol::find("never_stored").null());
+  cparse::rpnBuilder::cleanRPN(&rpn);
+}
+
+TEST_CASE("Zero-copy tokenizer", "[parser]") {
+  TokenMap vars;
+  vars["var_1"] = 2;
+  vars["_x9"] = 3;
+
+  // Identifiers, numbers and multi-character operators:
+  REQUIRE(calculator::calculate("var_1 * _x9 >= 6 && 0x10 == 16", vars).asBool());
+  REQUIRE(calculator::calculate("\t var_1 **\n2 ", vars).asInt() == 4);
+
+  // String literals with and without escape sequences:
+  REQUIRE(calculator::calculate("'plain text'").asString() == "plain text");
+  REQUIRE(calculator::calculate("\"a\\tb\\nc\"").asString() == "a\tb\nc");
+  REQUIRE(calculator::calculate("'it\\'s' + \"\\\"q\\\"\"").asString() == "it's\"q\"");
+
+  // Non ASCII characters belong to no character class:
+  using cparse::rpnBuilder;
+  REQUIRE(!rpnBuilder::isvarchar('\xC3'));
+  REQUIRE(rpnBuilder::scanVar("abc1+2").str() == "abc1");
+  REQUIRE(rpnBuilder::is(' ', cparse::SPACE_CHAR));
+  REQUIRE(!rpnBuilder::is('+', cparse::OP_CHAR));
+  REQUIRE(rpnBuilder::is('=', cparse::OP_CHAR));
+}
+
+void nil_word(const char* expr, const char** rest, rpnBuilder* data) {
+  data->handle_token(new cparse::TokenNone());
+}
+
+TEST_CASE("Lexer tables", "[parser][config]") {
+  using cparse::strView_t;
+
+  // Tries find the longest word at the start of a text:
+  cparse::lexTrie_t<int> trie;
+  trie.build({{"=", 1}, {"==", 2}, {"===", 3}, {"!", 4}});
+  size_t size;
+  REQUIRE(trie.longest(strView_t("==!", 3), &size) == 2);
+  REQUIRE(size == 2);
+  REQUIRE(trie.longest(strView_t("?=", 2), &size) == 0);
+  REQUIRE(size == 0);
+  REQUIRE(trie.find(strView_t("===", 3)) == 3);
+  REQUIRE(trie.find(strView_t("==!", 3)) == 0);
+
+  // They are rebuilt when operators or reserved words are added:
+  Config_t config = calculator::Default();
+  cparse::TokenQueue_t rpn = calculator::toRPN("1 @@ 2", vars, 0, 0, config);
+  REQUIRE(rpn.size() == 0);
+
+  config.opPrecedence.add("@@", 5);
+  config.parserMap.add("nil", &nil_word);
+  rpn = calculator::toRPN("nil @@ 2", vars, 0, 0, config);
+  REQUIRE(calculator::str(rpn) == "calculator { RPN: [ None, 2, @@ ] }");
+  rpnBuilder::cleanRPN(&rpn);
+
+  // Operators are split at the longest known prefix:
+  rpn = calculator::toRPN("1 @@- 2", vars, 0, 0, config);
+  REQUIRE(calculator::str(rpn) == "calculator { RPN: [ 1, UnaryToken, 2, -, @@ ] }");
+  rpnBuilder::cleanRPN(&rpn);
+  rpn = calculator::toRPN("1 @@@ 2", vars, 0, 0, config);
+  REQUIRE(rpn.size() == 0);
+}
+
+TEST_CASE("Numeric literals", "[parser]") {
+  using cparse::rpnBuilder;
+
+  // Integers in decimal, octal and hex notation:
+  REQUIRE(calculator::calculate("42")->type == INT_Token);
+  REQUIRE(calculator::calculate("42").asInt() == 42);
+  REQUIRE(calculator::calculate("017 + 0x1F + 0xff").asInt() == 15 + 31 + 255);
+  REQUIRE(calculator::calculate("9223372036854775807").asInt() == INT64_MAX);
+  REQUIRE(calculator::calculate("99999999999999999999").asInt() == INT64_MAX);
+
+  // Real numbers:
+  REQUIRE(calculator::calculate("1.5")->type == REAL_Token);
+  REQUIRE(calculator::calculate("2e3")->type == REAL_Token);
+  REQUIRE(calculator::calculate("1. + 2.5e-1 + 1e+1").asDouble() == 11.25);
+
+  // They are rounded as strtod() does in the "C" locale:
+  const char* reals[] = {
+    "0.1", "3.14159265358979323846", "2.2250738585072014e-308", "1.7976931348623157e308",
+    "4.9e-324", "123456789012345678901234567890.0", "0.000001234567890123456789",
+    "9007199254740993.0", "1e23", "8.589973e9", "1e400", "1e-400", "0.5e-22", "7e22"
+  };
+  bool same = true;
+  for (const char* real : reals) {
+    const char* rest;
+    packToken value(rpnBuilder::parseNumber(real, &rest));
+    same = same && value.asDouble() == strtod(real, 0) && *rest == '\0';
+  }
+  REQUIRE(same);
+
+  // The exponent is only read if it has digits:
+  const char* rest;
+  packToken value(rpnBuilder::parseNumber("1e+x", &rest));
+  REQUIRE(value.asDouble() == 1);
+  REQUIRE(std::string(rest) == "e+x");
+
+  // Nothing is read past the end of the literal, e.g.
+  // when it ends a buffer with no room after its NUL:
+  std::unique_ptr<char[]> buffer(new char[4]);
+  std::memcpy(buffer.get(), "0.5", 4);
+  packToken last(rpnBuilder::parseNumber(buffer.get(), &rest));
+  REQUIRE(last.asDouble() == 0.5);
+  REQUIRE(rest == buffer.get() + 3);
+  REQUIRE(calculator::calculate(buffer.get()).asDouble() == 0.5);
+}
+
+TEST_CASE("Compiled expression cache", "[calculate][cache]") {
+  cparse::ProgramCache cache(2);
+  const Config_t& config = calculator::Default();
+  TokenMap vars;
+  vars["x"] = 2;
+
+  // Programs are compiled once and shared by the calls:
+  const char* rest;
+  auto first = cache.get("x + 1", &rest, config);
+  REQUIRE(*rest == '\0');
+  REQUIRE(cache.get("x + 1", 0, config) == first);
+  REQUIRE(packToken(first->exec(vars, config)).asInt() == 3);
+
+  // The least recently used expressions are evicted first:
+  cache.get("x + 2", 0, config);
+  cache.get("x + 1", 0, config);
+  cache.get("x + 3", 0, config);
+  REQUIRE(cache.size() == 2);
+  REQUIRE(cache.get("x + 1", 0, config) == first);
+  REQUIRE(cache.stats().hits == 3);
+  REQUIRE(cache.stats().misses == 3);
+  REQUIRE(cache.stats().evictions == 1);
+
+  cache.set_capacity(0);
+  REQUIRE(cache.size() == 0);
+  REQUIRE(cache.get("x + 1", 0, config) == nullptr);
+
+  // Changing the config invalidates the programs compiled with it:
+  Config_t local = config;
+  cache.set_capacity(8);
+  first = cache.get("x + 1", 0, local);
+  REQUIRE(cache.get("x + 1", 0, local) == first);
+  local.opPrecedence.add("+", local.opPrecedence.prec("+"));
+  REQUIRE(cache.get("x + 1", 0, local) != first);
+  first = cache.get("x + 1", 0, local);
+  local.parserMap.add('$', nullptr);
+  REQUIRE(cache.get("x + 1", 0, local) != first);
+  first = cache.get("x + 1", 0, local);
+  local.opMap["+"];
+  REQUIRE(cache.get("x + 1", 0, local) != first);
+  REQUIRE(cache.get("x + 1", 0, local) == cache.get("x + 1", 0, local));
+
+  // calculate() uses the global cache if asked to, independently of the scope:
+  uint64_t hits = calculator::cache().stats().hits;
+  REQUIRE(calculator::calculate("x * 10 + 1", vars, 0, 0, true).asInt() == 21);
+  vars["x"] = 3;
+  REQUIRE(calculator::calculate("x * 10 + 1", vars, 0, 0, true).asInt() == 31);
+  REQUIRE(calculator::calculate("x * 10 + 1", TokenMap(), 0, 0, true).asBool() == false);
+  REQUIRE(calculator::cache().stats().hits == hits + 2);
+
+  // It is not used by default:
+  REQUIRE(calculator::calculate("x * 10 + 1", vars).asInt() == 31);
+  REQUIRE(calculator::cache().stats().hits == hits + 2);
+}
+
+TEST_CASE("Binary serialization", "[calculator][serialization]") {
+  using cparse::Schema;
+
+  GlobalScope global;
+  TokenMap scope(&global);
+  scope["x"] = 4;
+  scope["y"] = 2.5;
+
+  // The constants, the variables and the functions, by name, are saved:
+  calculator c1("sqrt(x) + y * 2 + (x + y) * (x + y) + str('a')", global);
+  std::string data = c1.save();
+  REQUIRE(data.substr(0, 4) == "CPRS");
+
+  calculator c2;
+  REQUIRE(c2.load(data, global) == true);
+  REQUIRE(c2.str() == c1.str());
+  REQUIRE(c2.eval(scope).asString() == "49.25a");
+  REQUIRE(c2.load(data, TokenMap(nullptr)) == false);
+
+  // And so are the schema and the engine:
+  c1.bind(Schema().add("x", NUM_Token));
+  c1.set_engine(calculator::CLOSURES);
+  REQUIRE(c2.load(c1.save(), global) == true);
+  REQUIRE(c2.get_engine() == calculator::CLOSURES);
+  REQUIRE(c2.get_schema().size() == 1);
+  REQUIRE(c2.eval({packToken(9)}, scope).asString() == "140.25a");
+
+  // Malformed data is rejected and the calculator is kept as it was:
+  REQUIRE(c2.load(data.substr(0, data.size() - 1), global) == false);
+  REQUIRE(c2.load(data + "!", global) == false);
+  std::string bad_magic = data, bad_version = data;
+  bad_magic[0] = 'X';
+  bad_version[4] = 2;
+  REQUIRE(c2.load(bad_magic, global) == false);
+  REQUIRE(c2.load(bad_version, global) == false);
+  REQUIRE(c2.get_engine() == calculator::CLOSURES);
+  REQUIRE(c2.eval({packToken(9)}, scope).asString() == "140.25a");
+
+  // Values that can't be saved, e.g. pointers:
+  scope["p"] = packToken(static_cast<const void*>(&scope));
+  REQUIRE(calculator("p", scope).save() == "");
+
+  // Expressions saved for another config are loaded
+  // only if all the operators they apply exist on it:
+  myCalc c3;
+  REQUIRE(calculator::fingerprint(myCalc::my_config()) !=
+          calculator::fingerprint(calculator::Default()));
+  REQUIRE(c3.load(calculator("x % 3").save()) == false);
+  REQUIRE(c3.load(calculator("x * 3").save()) == true);
+  REQUIRE(c3.eval(scope).asInt() == 12);
+
+  // Even on configs with ANY_OP operations, such as the default one:
+  std::string renamed = calculator("x + 1").save();
+  REQUIRE(renamed.substr(24, 5) == std::string("\x01\0\0\0+", 5));
+  renamed[8] ^= 1;
+  calculator c4;
+  REQUIRE(c4.load(renamed) == true);
+  REQUIRE(c4.eval(scope).asInt() == 5);
+  renamed[28] = '@';
+  REQUIRE(c4.load(renamed) == false);
+  REQUIRE(c4.eval(scope).asInt() == 5);
+}